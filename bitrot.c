@@ -17,6 +17,7 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
@@ -31,6 +32,13 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
+#ifdef LINUX
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
 #ifdef OPENSSL
 #include <openssl/md5.h>
 #elif GNUTLS
@@ -41,7 +49,17 @@
 #define DEBUG
 #include "common/conventions.h"
 #include "common/blockmem.h"
+#ifdef USEZLIB
+#include <zlib.h>
+#endif
+#ifdef USELZMA
+#include <lzma.h>
+#endif
+#ifdef USEZSTD
+#include <zstd.h>
+#endif
 #ifdef USEMMAP
+#include <sys/mman.h>
 #include "common/mmapwrapper.h"
 #endif
 
@@ -49,14 +67,17 @@
 #include "tarvars.h"
 #include "dirbyname.h"
 #include "filebyname.h"
+#include "bykey.h"
 
 SCLEARFUNC(file_bitrot);
 SCLEARFUNC(dir_bitrot);
+SCLEARFUNC(keyed_bitrot);
 
 static unsigned char zeromd5[16]={0xd4,0x1d,0x8c,0xd9,0x8f,0x00,0xb2,0x04,0xe9,0x80,0x09,0x98,0xec,0xf8,0x42,0x7e};
 
 void clear_bitrot(struct bitrot *bitrot) {
-static struct bitrot blank={.rootdir.xdev=INVALID_DEVT_BITROT,.options.ceiling_mtime=-1};
+static struct bitrot blank={.rootdir.xdev=INVALID_DEVT_BITROT,.options.ceiling_mtime=-1,.options.threads=1,
+		.options.smallfilemax=SMALLFILEMAX_BITROT};
 *bitrot=blank;
 }
 
@@ -71,10 +92,41 @@ error:
 }
 
 void deinit_bitrot(struct bitrot *bitrot) {
+if (bitrot->dents.buffers) {
+	unsigned int i;
+	for (i=0;i<bitrot->dents.count;i++) {
+		iffree(bitrot->dents.buffers[i].ptr);
+		iffree(bitrot->dents.buffers[i].entries);
+	}
+	free(bitrot->dents.buffers);
+}
+if (bitrot->shards.blockmems) {
+	unsigned int i;
+	for (i=0;i<bitrot->shards.count;i++) deinit_blockmem(&bitrot->shards.blockmems[i]);
+	free(bitrot->shards.blockmems);
+}
+if (bitrot->tarindex.fout) { // the scan didn't finish, don't leave half an index
+	(ignore)fclose(bitrot->tarindex.fout);
+	(ignore)unlink(bitrot->tarindex.tempname);
+}
 iffree(bitrot->iobuffer.ptr);
 deinit_blockmem(&bitrot->blockmem);
 }
 
+int writen_bitrot(int fd, unsigned char *msg, unsigned int len) {
+while (len) {
+	ssize_t k;
+	k=write(fd,(char *)msg,len);
+	if (k<=0) {
+		if (k && (errno==EINTR)) continue;
+		return -1;
+	}
+	len-=k;
+	msg+=k;
+}
+return 0;
+}
+
 static int loadhex(unsigned char *dest, unsigned int destlen, char *src) {
 while (1) {
 	unsigned int high,low,c;
@@ -111,7 +163,7 @@ error:
 	return -1;
 }
 
-static int findoradd_dir(struct dir_bitrot **dir_out, struct bitrot *bitrot, struct dir_bitrot *parent, char *name,
+static int findoradd_dir(struct dir_bitrot **dir_out, struct blockmem *blockmem, struct dir_bitrot *parent, char *name,
 		unsigned int flags) {
 struct dir_bitrot *dir;
 
@@ -128,9 +180,9 @@ if (dir) {
 	return 0;
 }
 
-if (!(dir=ALLOC_blockmem(&bitrot->blockmem,struct dir_bitrot))) GOTOERROR;
+if (!(dir=ALLOC_blockmem(blockmem,struct dir_bitrot))) GOTOERROR;
 clear_dir_bitrot(dir);
-if (!(dir->name=strdup_blockmem(&bitrot->blockmem,name))) GOTOERROR;
+if (!(dir->name=strdup_blockmem(blockmem,name))) GOTOERROR;
 dir->parent=parent;
 dir->flags=flags;
 (void)addnode2_dirbyname(&parent->children.topnode,dir);
@@ -141,34 +193,95 @@ error:
 	return -1;
 }
 
-static int addfileentry(struct bitrot *bitrot, char *filename, unsigned char *md5sum) {
-struct file_bitrot *file;
+static int resolve_cursor(struct dir_bitrot **dir_out, char **filename_out, struct cursor_bitrot *cursor,
+		struct blockmem *blockmem, struct dir_bitrot *top, char *path, unsigned int flags, int isadd) {
+// path is edited and changed back, *dir_out is NULL if !isadd and a directory is missing
+// directories are never freed, so cached pointers stay valid
 struct dir_bitrot *dir;
+char *slash,*component;
+unsigned int dirlen,depth,i,n;
+int isfull=0;
 
-dir=&bitrot->topdir;
+slash=strrchr(path,'/');
+dirlen=slash?(slash-path+1):0;
+*filename_out=path+dirlen;
+
+if (cursor->top!=top) {
+	cursor->top=top;
+	cursor->depth=0;
+	cursor->ends[0]=0;
+	cursor->dirs[0]=top;
+}
+depth=cursor->depth;
+n=cursor->ends[depth];
+if ((dirlen==n) && !memcmp(path,cursor->path,n)) { // same directory as last time
+	*dir_out=cursor->dirs[depth];
+	return 0;
+}
+if (n>dirlen) n=dirlen;
+for (i=0;i<n;i++) if (path[i]!=cursor->path[i]) break;
+while (cursor->ends[depth]>i) depth--; // back to the last whole component in common
+
+dir=cursor->dirs[depth];
+component=path+cursor->ends[depth];
 while (1) {
-	char *slash;
-	slash=strchr(filename,'/');
+	slash=strchr(component,'/');
 	if (!slash) break;
 	*slash=0;
-	if (!strcmp(filename,".")) {
+	if (!strcmp(component,".")) {
+	} else if (isadd) {
+		if (findoradd_dir(&dir,blockmem,dir,component,flags)) {
+			*slash='/';
+			cursor->depth=depth;
+			GOTOERROR;
+		}
+	} else {
+		dir=filename_find2_dirbyname(dir->children.topnode,component);
+		if (!dir) {
+			*slash='/';
+			cursor->depth=depth;
+			*dir_out=NULL;
+			return 0;
+		}
+	}
+	*slash='/';
+	component=slash+1;
+	n=component-path;
+	if (isfull || (depth==MAX_DEPTH_CURSOR_BITROT) || (n>MAX_PATH_CURSOR_BITROT)) {
+		isfull=1;
 	} else {
-		if (findoradd_dir(&dir,bitrot,dir,filename,ISINFILE_FLAG_BITROT)) GOTOERROR;
+		memcpy(cursor->path+cursor->ends[depth],path+cursor->ends[depth],n-cursor->ends[depth]);
+		depth++;
+		cursor->ends[depth]=n;
+		cursor->dirs[depth]=dir;
 	}
-	
-	filename=slash+1;
 }
+cursor->depth=depth;
+*dir_out=dir;
+return 0;
+error:
+	return -1;
+}
+
+static int addfileentry2(struct cursor_bitrot *cursor, struct blockmem *blockmem, struct dir_bitrot *dir, char *filename,
+		unsigned char *md5sum, int isreplace) {
+// filename is relative to dir
+struct file_bitrot *file;
+
+if (resolve_cursor(&dir,&filename,cursor,blockmem,dir,filename,ISINFILE_FLAG_BITROT,1)) GOTOERROR;
 
 file=filename_find2_filebyname(dir->files.topnode,filename);
 if (file) {
-	if (memcmp(file->md5,md5sum,LEN_MD5_BITROT)) {
+	if (isreplace) {
+		memcpy(file->md5,md5sum,LEN_MD5_BITROT);
+	} else if (memcmp(file->md5,md5sum,LEN_MD5_BITROT)) {
 		fprintf(stderr,"%s:%d duplicate file entry for \"%s\"\n",__FILE__,__LINE__,filename);
 		GOTOERROR;
 	}
 } else {
-	if (!(file=ALLOC_blockmem(&bitrot->blockmem,struct file_bitrot))) GOTOERROR;
+	if (!(file=ALLOC_blockmem(blockmem,struct file_bitrot))) GOTOERROR;
 	clear_file_bitrot(file);
-	if (!(file->name=strdup_blockmem(&bitrot->blockmem,filename))) GOTOERROR;
+	if (!(file->name=strdup_blockmem(blockmem,filename))) GOTOERROR;
 	file->flags=ISINFILE_FLAG_BITROT;
 	memcpy(file->md5,md5sum,LEN_MD5_BITROT);
 	(void)addnode2_filebyname(&dir->files.topnode,file);
@@ -178,13 +291,203 @@ error:
 	return -1;
 }
 
+static int addfileentry(struct bitrot *bitrot, char *filename, unsigned char *md5sum, int isreplace) {
+return addfileentry2(&bitrot->cursors.load,&bitrot->blockmem,&bitrot->topdir,filename,md5sum,isreplace);
+}
+
+static void removefileentry(struct bitrot *bitrot, char *filename) {
+// the file's node is dropped, directories are left alone
+struct file_bitrot *file;
+struct dir_bitrot *dir;
+
+dir=&bitrot->topdir;
+while (1) {
+	char *slash;
+	slash=strchr(filename,'/');
+	if (!slash) break;
+	*slash=0;
+	if (!strcmp(filename,".")) {
+	} else {
+		dir=filename_find2_dirbyname(dir->children.topnode,filename);
+		if (!dir) return;
+	}
+	filename=slash+1;
+}
+file=filename_find2_filebyname(dir->files.topnode,filename);
+if (file) rmnode2_filebyname(&dir->files.topnode,file,NULL);
+}
+
+static int isinsubtree(char *path, char *subtree) {
+// path is a catalog entry, subtree is from --subtree
+unsigned int n;
+while (!memcmp(path,"./",2)) path+=2;
+n=strlen(subtree);
+if (memcmp(path,subtree,n)) return 0;
+return path[n]=='/';
+}
+
+int setsubtree_bitrot(struct bitrot *b, char *path) {
+// "./a//b/" becomes "a/b"
+char *dest,*cursor;
+if (path[0]=='/') {
+	fprintf(stderr,"%s:%d --subtree should be relative to the directory, not \"%s\"\n",__FILE__,__LINE__,path);
+	GOTOERROR;
+}
+if (!(dest=alloc_blockmem(&b->blockmem,strlen(path)+1))) GOTOERROR;
+b->options.subtree=dest;
+cursor=path;
+while (*cursor) {
+	char *slash;
+	unsigned int n;
+	slash=strchr(cursor,'/');
+	if (slash) n=slash-cursor;
+	else n=strlen(cursor);
+	if ((n==2) && !memcmp(cursor,"..",2)) {
+		fprintf(stderr,"%s:%d --subtree can't leave the directory, \"%s\"\n",__FILE__,__LINE__,path);
+		GOTOERROR;
+	}
+	if (n && !((n==1) && (cursor[0]=='.'))) {
+		if (dest!=b->options.subtree) *dest++='/';
+		memcpy(dest,cursor,n);
+		dest+=n;
+	}
+	cursor+=n;
+	if (*cursor) cursor++;
+}
+*dest='\0';
+if (!b->options.subtree[0]) b->options.subtree=NULL; // "." is the whole tree
+return 0;
+error:
+	return -1;
+}
+
 // it's hard to get filenames this long but with utf16 and ././@LongLink, it gets big
 #define MAXLINELEN	2048
+
+static int parsesumline(char **path_out, unsigned char *md5_out, char *oneline, char *sumfile) {
+// oneline is from fgets, path_out is NULL for blank lines and comments
+int n;
+n=strlen(oneline);
+if (!n) GOTOERROR;
+*path_out=NULL;
+if (n==1) return 0;
+n--;
+if (oneline[n]!='\n') {
+	fprintf(stderr,"%s:%d input line is too long in %s\n",__FILE__,__LINE__,sumfile);
+	GOTOERROR;
+}
+oneline[n]='\0';
+if (oneline[0]=='#') return 0;
+if (n<LEN_MD5_BITROT*2+2+1) {
+	fprintf(stderr,"%s:%d bad line in %s, \"%s\"\n",__FILE__,__LINE__,sumfile,oneline);
+	GOTOERROR;
+}
+if (loadhex(md5_out,16,oneline)) {
+	fprintf(stderr,"%s:%d bad hash in %s, \"%s\"\n",__FILE__,__LINE__,sumfile,oneline);
+	GOTOERROR;
+}
+if ( (oneline[LEN_MD5_BITROT*2]!=' ') || (oneline[LEN_MD5_BITROT*2+1]!=' ') ) {
+	fprintf(stderr,"%s:%d bad delimiter in %s, \"%s\"\n",__FILE__,__LINE__,sumfile,oneline);
+	GOTOERROR;
+}
+*path_out=oneline+LEN_MD5_BITROT*2+2;
+return 0;
+error:
+	return -1;
+}
+
+static int loadchangelog(struct bitrot *bitrot) {
+// replays "+ md5  path" and "- path" records over the loaded sumfile
+FILE *ff=NULL;
+char *oneline=NULL;
+char *logfile;
+uint64_t validsize=0;
+
+logfile=bitrot->changelog.name;
+if (!(ff=fopen(logfile,"r"))) {
+	if (errno==ENOENT) return 0;
+	GOTOERROR;
+}
+if (!(oneline=malloc(MAXLINELEN))) GOTOERROR;
+if (!fgets(oneline,MAXLINELEN,ff) || strcmp(oneline,bitrot->changelog.identity)) {
+	// the sumfile was rewritten after this log was started, it's already included
+	if (bitrot->options.isverbose) {
+		fprintf(stderr,"%s:%d ignoring stale changelog %s\n",__FILE__,__LINE__,logfile);
+	}
+	free(oneline);
+	fclose(ff);
+	return 0;
+}
+validsize=strlen(oneline);
+while (1) {
+	int n;
+	unsigned char buff16[LEN_MD5_BITROT];
+	if (!fgets(oneline,MAXLINELEN,ff)) break;
+	n=strlen(oneline);
+	if (!n) GOTOERROR;
+	if (oneline[n-1]!='\n') {
+		if (feof(ff)) { // interrupted append, it will be truncated on the next one
+			fprintf(stderr,"%s:%d ignoring incomplete record at the end of %s\n",__FILE__,__LINE__,logfile);
+			break;
+		}
+		fprintf(stderr,"%s:%d input line is too long in %s\n",__FILE__,__LINE__,logfile);
+		GOTOERROR;
+	}
+	validsize+=n;
+	n--;
+	oneline[n]='\0';
+	if (!n) continue;
+	if (oneline[0]=='#') continue;
+	if ((n>=2+LEN_MD5_BITROT*2+2+1) && !memcmp(oneline,"+ ",2)) {
+		if (loadhex(buff16,16,oneline+2)) {
+			fprintf(stderr,"%s:%d bad hash in %s, \"%s\"\n",__FILE__,__LINE__,logfile,oneline);
+			GOTOERROR;
+		}
+		if ( (oneline[2+LEN_MD5_BITROT*2]!=' ') || (oneline[2+LEN_MD5_BITROT*2+1]!=' ') ) {
+			fprintf(stderr,"%s:%d bad delimiter in %s, \"%s\"\n",__FILE__,__LINE__,logfile,oneline);
+			GOTOERROR;
+		}
+		if (bitrot->options.subtree && !isinsubtree(oneline+2+LEN_MD5_BITROT*2+2,bitrot->options.subtree)) continue;
+		if (addfileentry(bitrot,oneline+2+LEN_MD5_BITROT*2+2,buff16,1)) GOTOERROR;
+	} else if ((n>=2+1) && !memcmp(oneline,"- ",2)) {
+		(void)removefileentry(bitrot,oneline+2);
+	} else {
+		fprintf(stderr,"%s:%d bad line in %s, \"%s\"\n",__FILE__,__LINE__,logfile,oneline);
+		GOTOERROR;
+	}
+}
+if (ferror(ff)) GOTOERROR;
+
+{
+	struct stat statbuf;
+	uint64_t mtime;
+	if (fstat(fileno(ff),&statbuf)) GOTOERROR;
+#ifdef LINUX
+	mtime=statbuf.st_mtim.tv_sec;
+#elif OSX
+	mtime=statbuf.st_mtimespec.tv_sec;
+#endif 
+	if (mtime>bitrot->sumfile.mtime) bitrot->sumfile.mtime=mtime; // the log has the last write
+}
+
+bitrot->changelog.isfound=1;
+bitrot->changelog.validsize=validsize;
+free(oneline);
+fclose(ff);
+return 0;
+error:
+	iffree(oneline);
+	iffclose(ff);
+	return -1;
+}
+
 int loadfile_bitrot(int *isnotfound_out, struct bitrot *bitrot, char *sumfile) {
 FILE *ff=NULL;
 char *oneline=NULL;
 
 if (!(bitrot->sumfile.name=strdup_blockmem(&bitrot->blockmem,sumfile))) GOTOERROR;
+if (!(bitrot->changelog.name=alloc_blockmem(&bitrot->blockmem,strlen(sumfile)+5))) GOTOERROR;
+sprintf(bitrot->changelog.name,"%s.log",sumfile);
 
 if (access(sumfile,F_OK)) {
 	if (errno==ENOENT) {
@@ -199,43 +502,34 @@ if (!(ff=fopen(sumfile,"r"))) GOTOERROR;
 	if (fstat(fileno(ff),&statbuf)) GOTOERROR;
 #ifdef LINUX
 	bitrot->sumfile.mtime=statbuf.st_mtim.tv_sec;
+	snprintf(bitrot->changelog.identity,MAX_IDENTITY_CHANGELOG_BITROT+1,"# bitrotchecker changelog %"PRIu64" %"PRIu64".%09lu\n",
+			(uint64_t)statbuf.st_size,(uint64_t)statbuf.st_mtim.tv_sec,(unsigned long)statbuf.st_mtim.tv_nsec);
 #elif OSX
 	bitrot->sumfile.mtime=statbuf.st_mtimespec.tv_sec;
+	snprintf(bitrot->changelog.identity,MAX_IDENTITY_CHANGELOG_BITROT+1,"# bitrotchecker changelog %"PRIu64" %"PRIu64".%09lu\n",
+			(uint64_t)statbuf.st_size,(uint64_t)statbuf.st_mtimespec.tv_sec,(unsigned long)statbuf.st_mtimespec.tv_nsec);
 #endif 
+	bitrot->changelog.basesize=statbuf.st_size;
+	bitrot->changelog.isbase=1;
 }
 if (!(oneline=malloc(MAXLINELEN))) GOTOERROR;
 while (1) {
-	int n;
 	unsigned char buff16[LEN_MD5_BITROT];
+	char *path;
 	if (!fgets(oneline,MAXLINELEN,ff)) break;
-	n=strlen(oneline);
-	if (!n) GOTOERROR;
-	if (n==1) continue;
-	n--;
-	if (oneline[n]!='\n') {
-		fprintf(stderr,"%s:%d input line is too long in %s\n",__FILE__,__LINE__,sumfile);
-		GOTOERROR;
-	}
-	oneline[n]='\0';
-	if (oneline[0]=='#') continue;
-	if (n<LEN_MD5_BITROT*2+2+1) {
-		fprintf(stderr,"%s:%d bad line in %s, \"%s\"\n",__FILE__,__LINE__,sumfile,oneline);
-		GOTOERROR;
-	}
-	if (loadhex(buff16,16,oneline)) {
-		fprintf(stderr,"%s:%d bad hash in %s, \"%s\"\n",__FILE__,__LINE__,sumfile,oneline);
-		GOTOERROR;
-	}
-	if ( (oneline[LEN_MD5_BITROT*2]!=' ') || (oneline[LEN_MD5_BITROT*2+1]!=' ') ) {
-		fprintf(stderr,"%s:%d bad delimiter in %s, \"%s\"\n",__FILE__,__LINE__,sumfile,oneline);
-		GOTOERROR;
-	}
-	if (addfileentry(bitrot,oneline+LEN_MD5_BITROT*2+2,buff16)) GOTOERROR;
+	if (parsesumline(&path,buff16,oneline,sumfile)) GOTOERROR;
+	if (!path) continue;
+	if (bitrot->options.subtree && !isinsubtree(path,bitrot->options.subtree)) continue;
+	if (addfileentry(bitrot,path,buff16,0)) GOTOERROR;
 }
 
 if (ferror(ff)) GOTOERROR;
 free(oneline);
+oneline=NULL;
 fclose(ff);
+ff=NULL;
+
+if (loadchangelog(bitrot)) GOTOERROR;
 *isnotfound_out=0;
 return 0;
 error:
@@ -274,372 +568,2854 @@ dest[0]=' ';
 dest[1]=' ';
 }
 
-static int writefiletofile(struct dir_bitrot *dir, struct file_bitrot *file, FILE *ff) {
-unsigned char hexbuff[LEN_MD5_BITROT*2+2];
-if (file->treevars.left) {
-	if (writefiletofile(dir,file->treevars.left,ff)) GOTOERROR;
+struct jobs_bitrot {
+	pthread_mutex_t mutex;
+	unsigned int next,count;
+	int (*job)(void *arg, unsigned int i);
+	void *arg;
+	int iserror;
+};
+
+static void *jobs_thread(void *arg) {
+struct jobs_bitrot *jobs=arg;
+while (1) {
+	unsigned int i;
+	(ignore)pthread_mutex_lock(&jobs->mutex);
+	if ((jobs->next==jobs->count) || jobs->iserror) {
+		(ignore)pthread_mutex_unlock(&jobs->mutex);
+		break;
+	}
+	i=jobs->next;
+	jobs->next+=1;
+	(ignore)pthread_mutex_unlock(&jobs->mutex);
+	if (jobs->job(jobs->arg,i)) {
+		(ignore)pthread_mutex_lock(&jobs->mutex);
+		jobs->iserror=1;
+		(ignore)pthread_mutex_unlock(&jobs->mutex);
+	}
+}
+return NULL;
 }
 
-if (file->flags&ISFOUND_FLAG_BITROT) {
-	(void)sethexbuff(hexbuff,file->md5,LEN_MD5_BITROT);
-	if (1!=fwrite(hexbuff,LEN_MD5_BITROT*2+2,1,ff)) GOTOERROR;
-	if (printpath(dir,ff)) GOTOERROR;
-	if (0>fputs(file->name,ff)) GOTOERROR;
-	if (0>fputc('\n',ff)) GOTOERROR;
+static int runjobs(unsigned int threads, unsigned int count, int (*job)(void *arg, unsigned int i), void *arg) {
+// runs job(arg,0..count-1) on up to threads threads
+struct jobs_bitrot jobs;
+pthread_t *tids=NULL;
+unsigned int tidcount=0;
+unsigned int i;
+
+if (threads>count) threads=count;
+if (threads<=1) {
+	for (i=0;i<count;i++) {
+		if (job(arg,i)) GOTOERROR;
+	}
+	return 0;
 }
 
-if (file->treevars.right) {
-	if (writefiletofile(dir,file->treevars.right,ff)) GOTOERROR;
+memset(&jobs,0,sizeof(jobs));
+jobs.count=count;
+jobs.job=job;
+jobs.arg=arg;
+if (pthread_mutex_init(&jobs.mutex,NULL)) GOTOERROR;
+if (!(tids=malloc(threads*sizeof(pthread_t)))) {
+	(ignore)pthread_mutex_destroy(&jobs.mutex);
+	GOTOERROR;
+}
+for (i=0;i<threads;i++) {
+	if (pthread_create(&tids[i],NULL,jobs_thread,&jobs)) break;
+	tidcount+=1;
+}
+if (!tidcount) (void)jobs_thread(&jobs);
+for (i=0;i<tidcount;i++) {
+	(ignore)pthread_join(tids[i],NULL);
 }
+free(tids);
+(ignore)pthread_mutex_destroy(&jobs.mutex);
+if (jobs.iserror) GOTOERROR;
 return 0;
 error:
 	return -1;
 }
 
-static int writedirtofile(struct dir_bitrot *dir, FILE *ff) {
-if (dir->treevars.left) {
-	if (writedirtofile(dir->treevars.left,ff)) GOTOERROR;
+struct writer_bitrot {
+	int fd;
+	int ischangelog; // write +/- records instead of the sumfile
+	unsigned char *buffer;
+	unsigned int num,max;
+	char *path; // running prefix, "dir/subdir/"
+	unsigned int pathlen,pathmax;
+};
+SCLEARFUNC(writer_bitrot);
+
+static int init_writer(struct writer_bitrot *w, int fd) {
+void *ptr;
+w->fd=fd;
+w->max=WRITECHUNK_BITROT;
+if (posix_memalign(&ptr,4096,w->max)) GOTOERROR;
+w->buffer=ptr;
+w->pathmax=MAXLINELEN;
+if (!(w->path=malloc(w->pathmax))) GOTOERROR;
+return 0;
+error:
+	return -1;
 }
-if (dir->children.topnode) {
-	if (writedirtofile(dir->children.topnode,ff)) GOTOERROR;
+
+static void deinit_writer(struct writer_bitrot *w) {
+iffree(w->buffer);
+iffree(w->path);
 }
-if (dir->files.topnode) {
-	if (writefiletofile(dir,dir->files.topnode,ff)) GOTOERROR;
+
+static int flush_writer(struct writer_bitrot *w) {
+if (!w->num) return 0;
+if (w->fd<0) { // --dry-run
+	w->num=0;
+	return 0;
 }
-if (dir->treevars.right) {
-	if (writedirtofile(dir->treevars.right,ff)) GOTOERROR;
+if (writen_bitrot(w->fd,w->buffer,w->num)) GOTOERROR;
+w->num=0;
+return 0;
+error:
+	return -1;
+}
+
+static int addpath_writer(struct writer_bitrot *w, char *name) {
+unsigned int n;
+n=strlen(name);
+if (w->pathlen+n+1>w->pathmax) {
+	char *temp;
+	unsigned int newmax;
+	newmax=w->pathlen+n+1+MAXLINELEN;
+	if (!(temp=realloc(w->path,newmax))) GOTOERROR;
+	w->path=temp;
+	w->pathmax=newmax;
 }
+memcpy(w->path+w->pathlen,name,n);
+w->pathlen+=n;
+w->path[w->pathlen]='/';
+w->pathlen+=1;
 return 0;
 error:
 	return -1;
 }
 
-int writefile_bitrot(struct bitrot *b, char *filename) {
-FILE *ff=NULL;
-if (!(ff=fopen(filename,"w"))) GOTOERROR;
+static int reserve_writer(struct writer_bitrot *w, unsigned int linelen) {
+if (w->num+linelen>w->max) {
+	if (flush_writer(w)) GOTOERROR;
+	if (linelen>w->max) { // only for absurd paths, keep the alignment by reallocating
+		void *ptr;
+		unsigned int newmax;
+		newmax=((linelen-1)|4095)+1;
+		if (posix_memalign(&ptr,4096,newmax)) GOTOERROR;
+		free(w->buffer);
+		w->buffer=ptr;
+		w->max=newmax;
+	}
+}
+return 0;
+error:
+	return -1;
+}
 
-if (writedirtofile(&b->topdir,ff)) GOTOERROR;
+static int addline_writer(struct writer_bitrot *w, unsigned char *md5, char *name) {
+unsigned char *dest;
+unsigned int n,linelen;
+n=strlen(name);
+linelen=LEN_MD5_BITROT*2+2+w->pathlen+n+1;
+if (reserve_writer(w,linelen)) GOTOERROR;
+dest=w->buffer+w->num;
+(void)sethexbuff(dest,md5,LEN_MD5_BITROT);
+dest+=LEN_MD5_BITROT*2+2;
+memcpy(dest,w->path,w->pathlen);
+dest+=w->pathlen;
+memcpy(dest,name,n);
+dest[n]='\n';
+w->num+=linelen;
+return 0;
+error:
+	return -1;
+}
 
-if (ferror(ff)) GOTOERROR;
-if (fclose(ff)) {
-	ff=NULL;
-	GOTOERROR;
+static int addrecord_writer(struct writer_bitrot *w, int op, unsigned char *md5, char *name) {
+// changelog records: "+ md5  path" and "- path"
+unsigned char *dest;
+unsigned int n,linelen;
+n=strlen(name);
+linelen=2+w->pathlen+n+1;
+if (md5) linelen+=LEN_MD5_BITROT*2+2;
+if (reserve_writer(w,linelen)) GOTOERROR;
+dest=w->buffer+w->num;
+dest[0]=op;
+dest[1]=' ';
+dest+=2;
+if (md5) {
+	(void)sethexbuff(dest,md5,LEN_MD5_BITROT);
+	dest+=LEN_MD5_BITROT*2+2;
 }
+memcpy(dest,w->path,w->pathlen);
+dest+=w->pathlen;
+memcpy(dest,name,n);
+dest[n]='\n';
+w->num+=linelen;
 return 0;
 error:
-	iffclose(ff);
 	return -1;
 }
 
-static int printdirtree(struct dir_bitrot *dir, int depth, FILE *fout) {
-if (dir->treevars.left) {
-	(ignore)printdirtree(dir->treevars.left,depth,fout);
+static int writefiles_writer(struct writer_bitrot *w, struct file_bitrot *file) {
+if (file->treevars.left) {
+	if (writefiles_writer(w,file->treevars.left)) GOTOERROR;
 }
-int i;
-for (i=0;i<depth;i++) fputc(' ',fout);
-fputs(dir->name,fout);
-fputc('\n',fout);
-if (dir->children.topnode) printdirtree(dir->children.topnode,depth+1,fout);
 
-if (dir->treevars.right) {
-	(ignore)printdirtree(dir->treevars.right,depth,fout);
+if (w->ischangelog) {
+	if (file->flags&ISFOUND_FLAG_BITROT) {
+		if (file->flags&ISCHANGED_FLAG_BITROT) {
+			if (addrecord_writer(w,'+',file->md5,file->name)) GOTOERROR;
+		}
+	} else if (file->flags&ISINFILE_FLAG_BITROT) {
+		if (addrecord_writer(w,'-',NULL,file->name)) GOTOERROR;
+	}
+} else if (file->flags&ISFOUND_FLAG_BITROT) {
+	if (addline_writer(w,file->md5,file->name)) GOTOERROR;
+}
+
+if (file->treevars.right) {
+	if (writefiles_writer(w,file->treevars.right)) GOTOERROR;
 }
 return 0;
+error:
+	return -1;
 }
 
-int printtree_bitrot(struct bitrot *b, FILE *fout) {
-// TODO handle errors
-struct dir_bitrot *dir;
-
-dir=&b->topdir;
-(ignore)printdirtree(dir,1,fout);
+static int writedir_writer(struct writer_bitrot *w, struct dir_bitrot *dir);
+static int writeone_writer(struct writer_bitrot *w, struct dir_bitrot *dir) {
+// just dir, not its siblings
+unsigned int pathlen;
+pathlen=w->pathlen;
+if (dir->name[0]) {
+	if (addpath_writer(w,dir->name)) GOTOERROR;
+}
+if (dir->children.topnode) {
+	if (writedir_writer(w,dir->children.topnode)) GOTOERROR;
+}
+if (dir->files.topnode) {
+	if (writefiles_writer(w,dir->files.topnode)) GOTOERROR;
+}
+w->pathlen=pathlen;
 return 0;
+error:
+	return -1;
 }
 
-static void unprintprogress(struct bitrot *b) {
-char *line;
-int n;
+static int writedir_writer(struct writer_bitrot *w, struct dir_bitrot *dir) {
+if (dir->treevars.left) {
+	if (writedir_writer(w,dir->treevars.left)) GOTOERROR;
+}
+if (writeone_writer(w,dir)) GOTOERROR;
+if (dir->treevars.right) {
+	if (writedir_writer(w,dir->treevars.right)) GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
 
-if (!b->progress.isprinted) return;
-b->progress.isprinted=0;
+struct segment_bitrot {
+	struct dir_bitrot *dir;
+	int fd;
+};
 
-n=b->progress.linelength;
-line=b->progress.line;
+struct segments_bitrot {
+	unsigned int count,max;
+	struct segment_bitrot *list;
+	char *dirname; // for the temp files, to stay on the same filesystem as the catalog
+};
 
-memset(line,' ',n);
-line[n]='\r';
+static int addsegments(struct segments_bitrot *segs, struct dir_bitrot *dir) {
+// in order, matching writedir_writer
+if (dir->treevars.left) {
+	if (addsegments(segs,dir->treevars.left)) GOTOERROR;
+}
+if (segs->count==segs->max) {
+	struct segment_bitrot *temp;
+	unsigned int newmax;
+	newmax=segs->max*2+64;
+	if (!(temp=realloc(segs->list,newmax*sizeof(struct segment_bitrot)))) GOTOERROR;
+	segs->list=temp;
+	segs->max=newmax;
+}
+segs->list[segs->count].dir=dir;
+segs->list[segs->count].fd=-1;
+segs->count+=1;
+if (dir->treevars.right) {
+	if (addsegments(segs,dir->treevars.right)) GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
+
+static int opensegment(char *dirname) {
+int fd;
+#ifdef O_TMPFILE
+fd=open(dirname,O_TMPFILE|O_RDWR,0600);
+if (fd>=0) return fd;
+#endif
+{
+	char *tempname;
+	if (!(tempname=malloc(strlen(dirname)+16))) return -1;
+	sprintf(tempname,"%s/.bitrot.XXXXXX",dirname);
+	fd=mkstemp(tempname);
+	if (fd>=0) (ignore)unlink(tempname);
+	free(tempname);
+}
+return fd;
+}
+
+static int writesegment(void *arg, unsigned int i) {
+struct segments_bitrot *segs=arg;
+struct segment_bitrot *seg=&segs->list[i];
+struct writer_bitrot w;
+
+clear_writer_bitrot(&w);
+if (0>(seg->fd=opensegment(segs->dirname))) GOTOERROR;
+if (init_writer(&w,seg->fd)) GOTOERROR;
+if (writeone_writer(&w,seg->dir)) GOTOERROR;
+if (flush_writer(&w)) GOTOERROR;
+deinit_writer(&w);
+return 0;
+error:
+	deinit_writer(&w);
+	return -1;
+}
+
+static int copysegment(int fd, int segfd) {
+uint64_t offset=0;
+unsigned char *buffer=NULL;
+#ifdef LINUX
+while (1) {
+	ssize_t k;
+	k=copy_file_range(segfd,(off64_t *)&offset,fd,NULL,WRITECHUNK_BITROT*16,0);
+	if (k<=0) {
+		if (!k) return 0;
+		if (errno==EINTR) continue;
+		if ((errno==EXDEV) || (errno==ENOSYS) || (errno==EINVAL) || (errno==EOPNOTSUPP)) break;
+		GOTOERROR;
+	}
+}
+#endif
+// fallback, offset is still valid for the part we haven't copied
+if (!(buffer=malloc(WRITECHUNK_BITROT))) GOTOERROR;
+while (1) {
+	ssize_t k;
+	k=pread(segfd,buffer,WRITECHUNK_BITROT,offset);
+	if (k<=0) {
+		if (!k) break;
+		if (errno==EINTR) continue;
+		GOTOERROR;
+	}
+	if (writen_bitrot(fd,buffer,k)) GOTOERROR;
+	offset+=k;
+}
+free(buffer);
+return 0;
+error:
+	iffree(buffer);
+	return -1;
+}
+
+static int parallel_writer(struct writer_bitrot *w, struct dir_bitrot *topdir, char *dirname, unsigned int threads) {
+// top-level subtrees are written to temp segments by threads, then concatenated in order
+struct segments_bitrot segs;
+unsigned int i;
+
+memset(&segs,0,sizeof(segs));
+segs.dirname=dirname;
+if (addsegments(&segs,topdir->children.topnode)) GOTOERROR;
+
+if (runjobs(threads,segs.count,writesegment,&segs)) GOTOERROR;
+
+if (flush_writer(w)) GOTOERROR;
+for (i=0;i<segs.count;i++) {
+	struct segment_bitrot *seg=&segs.list[i];
+	if (copysegment(w->fd,seg->fd)) GOTOERROR;
+	(ignore)close(seg->fd);
+	seg->fd=-1;
+}
+if (topdir->files.topnode) {
+	if (writefiles_writer(w,topdir->files.topnode)) GOTOERROR;
+}
+
+free(segs.list);
+return 0;
+error:
+	for (i=0;i<segs.count;i++) {
+		ifclose(segs.list[i].fd);
+	}
+	iffree(segs.list);
+	return -1;
+}
+
+static int opentemp(int *fd_out, char **tempname_out, char *filename) {
+// the temp file is in the same directory, so rename() is atomic
+struct stat statbuf;
+char *tempname=NULL;
+mode_t mode;
+int fd=-1;
+
+if (!(tempname=malloc(strlen(filename)+8))) GOTOERROR;
+sprintf(tempname,"%s.XXXXXX",filename);
+fd=mkstemp(tempname);
+if (fd<0) {
+	fprintf(stderr,"%s:%d error creating temp file %s (%s)\n",__FILE__,__LINE__,tempname,strerror(errno));
+	free(tempname);
+	tempname=NULL;
+	GOTOERROR;
+}
+if (!stat(filename,&statbuf)) {
+	mode=statbuf.st_mode&07777;
+} else {
+	mode=umask(0);
+	(ignore)umask(mode);
+	mode=0666&~mode;
+}
+if (fchmod(fd,mode)) GOTOERROR;
+
+*fd_out=fd;
+*tempname_out=tempname;
+return 0;
+error:
+	ifclose(fd);
+	if (tempname) {
+		(ignore)unlink(tempname);
+		free(tempname);
+	}
+	return -1;
+}
+
+static int keepmtime(int fd, struct timespec *mtime) {
+// --subtree: entries outside the subtree weren't checked again, so the file keeps its old mtime
+struct timespec times[2];
+times[0].tv_sec=0;
+times[0].tv_nsec=UTIME_OMIT;
+times[1]=*mtime;
+if (futimens(fd,times)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+static inline void getmtime_stat(struct timespec *mtime_out, struct stat *statbuf) {
+#ifdef LINUX
+*mtime_out=statbuf->st_mtim;
+#elif OSX
+*mtime_out=statbuf->st_mtimespec;
+#endif 
+}
+
+static int committemp(int fd, char *tempname, char *filename) {
+// consumes fd
+char *slash;
+if (fsync(fd)) GOTOERROR;
+if (close(fd)) {
+	fd=-1;
+	GOTOERROR;
+}
+fd=-1;
+if (rename(tempname,filename)) {
+	fprintf(stderr,"%s:%d error renaming %s to %s (%s)\n",__FILE__,__LINE__,tempname,filename,strerror(errno));
+	GOTOERROR;
+}
+slash=strrchr(filename,'/'); // sync the directory entry too
+if (!slash) {
+	fd=open(".",O_RDONLY);
+} else if (slash==filename) {
+	fd=open("/",O_RDONLY);
+} else {
+	char *dirname;
+	if ((dirname=strndup(filename,slash-filename))) {
+		fd=open(dirname,O_RDONLY);
+		free(dirname);
+	}
+}
+if (fd>=0) {
+	(ignore)fsync(fd);
+	(ignore)close(fd);
+}
+return 0;
+error:
+	ifclose(fd);
+	return -1;
+}
+
+static char *resolvesumfile(char *filename) {
+// we replace the file by rename(), a symlink should keep pointing to the replacement
+struct stat statbuf;
+if (lstat(filename,&statbuf)) return NULL;
+if (!S_ISLNK(statbuf.st_mode)) return NULL;
+return realpath(filename,NULL);
+}
+
+int writefile_bitrot(struct bitrot *b, char *filename) {
+struct writer_bitrot w;
+char *tempname=NULL,*realname=NULL;
+int fd=-1;
+
+clear_writer_bitrot(&w);
+
+realname=resolvesumfile(filename);
+if (realname) filename=realname;
+
+if (opentemp(&fd,&tempname,filename)) GOTOERROR;
+if (init_writer(&w,fd)) GOTOERROR;
+
+if ((b->options.threads>1) && b->topdir.children.topnode) {
+	char *slash;
+	slash=strrchr(tempname,'/');
+	if (!slash) {
+		if (parallel_writer(&w,&b->topdir,".",b->options.threads)) GOTOERROR;
+	} else if (slash==tempname) {
+		if (parallel_writer(&w,&b->topdir,"/",b->options.threads)) GOTOERROR;
+	} else {
+		int r;
+		*slash='\0';
+		r=parallel_writer(&w,&b->topdir,tempname,b->options.threads);
+		*slash='/';
+		if (r) GOTOERROR;
+	}
+} else {
+	if (writedir_writer(&w,&b->topdir)) GOTOERROR;
+}
+if (flush_writer(&w)) GOTOERROR;
+
+fd=-1;
+if (committemp(w.fd,tempname,filename)) GOTOERROR;
+if (b->changelog.name) { // everything in the log is in the sumfile now
+	if (unlink(b->changelog.name)) {
+		if (errno!=ENOENT) GOTOERROR;
+	}
+}
+
+deinit_writer(&w);
+free(tempname);
+iffree(realname);
+return 0;
+error:
+	deinit_writer(&w);
+	ifclose(fd);
+	if (tempname) {
+		(ignore)unlink(tempname);
+		free(tempname);
+	}
+	iffree(realname);
+	return -1;
+}
+
+#define HASFOUND_SHARD_BITROT	1
+#define ISDIRTY_SHARD_BITROT	2
+
+static unsigned int filesstatus(struct file_bitrot *file) {
+unsigned int status=0;
+if (file->treevars.left) status|=filesstatus(file->treevars.left);
+if (file->flags&ISFOUND_FLAG_BITROT) {
+	status|=HASFOUND_SHARD_BITROT;
+	if (file->flags&ISCHANGED_FLAG_BITROT) status|=ISDIRTY_SHARD_BITROT;
+} else if (file->flags&ISINFILE_FLAG_BITROT) { // it'll be dropped
+	status|=ISDIRTY_SHARD_BITROT;
+}
+if (file->treevars.right) status|=filesstatus(file->treevars.right);
+return status;
+}
+
+static unsigned int dirstatus(struct dir_bitrot *dir) {
+// dir and its siblings
+unsigned int status=0;
+if (dir->treevars.left) status|=dirstatus(dir->treevars.left);
+if (dir->children.topnode) status|=dirstatus(dir->children.topnode);
+if (dir->files.topnode) status|=filesstatus(dir->files.topnode);
+if (dir->treevars.right) status|=dirstatus(dir->treevars.right);
+return status;
+}
+
+static int cmppath_stream(char *a, char *b);
+static int splicefile(int *isempty_out, struct bitrot *b, char *filename) {
+// --subtree: lines outside the subtree are copied, the scanned subtree replaces the lines inside it
+struct writer_bitrot w;
+FILE *ff=NULL;
+char *oneline=NULL,*probe=NULL,*tempname=NULL,*realname=NULL;
+char *subtree=b->options.subtree;
+struct timespec mtime={0,0};
+unsigned int count=0;
+int isblock=0,ismtime=0;
+int fd=-1;
+
+clear_writer_bitrot(&w);
+
+realname=resolvesumfile(filename);
+if (realname) filename=realname;
+
+if (!(probe=malloc(strlen(subtree)+3))) GOTOERROR;
+sprintf(probe,"%s/x",subtree); // any path in the subtree, to find where it goes in the order
+
+if (opentemp(&fd,&tempname,filename)) GOTOERROR;
+if (init_writer(&w,fd)) GOTOERROR;
+if (!(ff=fopen(filename,"r"))) {
+	if (errno!=ENOENT) GOTOERROR;
+} else {
+	struct stat statbuf;
+	if (fstat(fileno(ff),&statbuf)) GOTOERROR;
+	(void)getmtime_stat(&mtime,&statbuf);
+	ismtime=1;
+	if (!(oneline=malloc(MAXLINELEN))) GOTOERROR;
+	while (1) {
+		unsigned char buff16[LEN_MD5_BITROT];
+		char *path;
+		unsigned int n;
+		if (!fgets(oneline,MAXLINELEN,ff)) break;
+		n=strlen(oneline);
+		if (parsesumline(&path,buff16,oneline,filename)) GOTOERROR;
+		if (path) {
+			if (isinsubtree(path,subtree)) {
+				if (!isblock) {
+					if (writeone_writer(&w,&b->topdir)) GOTOERROR;
+					isblock=1;
+				}
+				continue;
+			}
+			if (!isblock) {
+				char *p=path;
+				while (!memcmp(p,"./",2)) p+=2;
+				if (0<cmppath_stream(p,probe)) {
+					if (writeone_writer(&w,&b->topdir)) GOTOERROR;
+					isblock=1;
+				}
+			}
+			count+=1;
+		}
+		oneline[n-1]='\n';
+		if (reserve_writer(&w,n)) GOTOERROR;
+		memcpy(w.buffer+w.num,oneline,n);
+		w.num+=n;
+	}
+	if (ferror(ff)) GOTOERROR;
+	fclose(ff);
+	ff=NULL;
+}
+if (!isblock) {
+	if (writeone_writer(&w,&b->topdir)) GOTOERROR;
+}
+if (flush_writer(&w)) GOTOERROR;
+if (ismtime) {
+	if (keepmtime(w.fd,&mtime)) GOTOERROR;
+}
+fd=-1;
+if (committemp(w.fd,tempname,filename)) GOTOERROR;
+
+*isempty_out=0;
+if (!count) {
+	if (!b->topdir.children.topnode || !(dirstatus(b->topdir.children.topnode)&HASFOUND_SHARD_BITROT)) *isempty_out=1;
+}
+deinit_writer(&w);
+free(tempname);
+free(probe);
+iffree(oneline);
+iffree(realname);
+return 0;
+error:
+	deinit_writer(&w);
+	iffclose(ff);
+	ifclose(fd);
+	if (tempname) {
+		(ignore)unlink(tempname);
+		free(tempname);
+	}
+	iffree(probe);
+	iffree(oneline);
+	iffree(realname);
+	return -1;
+}
+
+static int writechanges(struct bitrot *b) {
+// appends the difference between the loaded sumfile and the scan to the changelog
+struct writer_bitrot w;
+struct stat statbuf;
+int fd=-1;
+
+clear_writer_bitrot(&w);
+
+fd=open(b->changelog.name,O_WRONLY|O_CREAT,0666);
+if (fd<0) GOTOERROR;
+if (b->changelog.isfound) { // drop a torn record from an interrupted append
+	if (ftruncate(fd,b->changelog.validsize)) GOTOERROR;
+} else {
+	if (ftruncate(fd,0)) GOTOERROR;
+}
+if (0>lseek(fd,0,SEEK_END)) GOTOERROR;
+
+if (init_writer(&w,fd)) GOTOERROR;
+w.ischangelog=1;
+if (!b->changelog.isfound) {
+	unsigned int n;
+	n=strlen(b->changelog.identity);
+	memcpy(w.buffer,b->changelog.identity,n);
+	w.num=n;
+}
+if (writedir_writer(&w,&b->topdir)) GOTOERROR;
+if (flush_writer(&w)) GOTOERROR;
+if (b->options.subtree) { // the loaded mtime is the later of the sumfile and the log
+	struct timespec mtime;
+	mtime.tv_sec=b->sumfile.mtime;
+	mtime.tv_nsec=0;
+	if (keepmtime(fd,&mtime)) GOTOERROR;
+}
+if (fsync(fd)) GOTOERROR;
+if (fstat(fd,&statbuf)) GOTOERROR;
+b->changelog.size=statbuf.st_size;
+if (close(fd)) {
+	fd=-1;
+	GOTOERROR;
+}
+deinit_writer(&w);
+return 0;
+error:
+	deinit_writer(&w);
+	ifclose(fd);
+	return -1;
+}
+
+int savefile_bitrot(struct bitrot *b, char *filename) {
+if (b->options.subtree) { // never compacted, the tree only has the subtree
+	if ((b->options.ischangelog && b->changelog.isbase) || b->changelog.isfound) { // a log needs a sumfile to extend
+		if (writechanges(b)) GOTOERROR;
+	} else {
+		int isempty;
+		if (splicefile(&isempty,b,filename)) GOTOERROR;
+	}
+	return 0;
+}
+if (b->options.ischangelog && b->changelog.isbase && !b->options.iscompact) {
+	if (writechanges(b)) GOTOERROR;
+	if (b->changelog.size*COMPACTRATIO_CHANGELOG_BITROT<=b->changelog.basesize) return 0;
+	if (b->options.isverbose) {
+		fprintf(stderr,"%s:%d compacting changelog %s\n",__FILE__,__LINE__,b->changelog.name);
+	}
+}
+if (writefile_bitrot(b,filename)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+#define MANIFEST_SHARDS_BITROT	"manifest"
+#define ROOT_SHARDS_BITROT	"top.md5"
+#define HEADER_SHARDS_BITROT	"# bitrotchecker shards 1\n"
+#define MAXNAME_SHARDS_BITROT	200
+
+static int md5string(unsigned char *dest, char *str) {
+MD5_CTX ctx;
+unsigned int n;
+n=strlen(str);
+#ifdef OPENSSL
+if (1!=MD5_Init(&ctx)) return -1;
+if (1!=MD5_Update(&ctx,str,n)) return -1;
+if (1!=MD5_Final(dest,&ctx)) return -1;
+#elif GNUTLS
+(void)MD5_Init(&ctx);
+(void)MD5_Update(&ctx,str,n);
+(void)MD5_Final(dest,&ctx);
+#else
+(void)clear_context_md5(&ctx);
+(void)addbytes_context_md5(&ctx,(unsigned char *)str,n);
+(void)finish_context_md5(dest,&ctx);
+#endif
+return 0;
+}
+
+static char *shardname(char *name) {
+// "d-name.md5" with unsafe bytes as %XX, or "h-md5ofname.md5" if that would be too long for a filename
+static char hexvals[]="0123456789abcdef";
+unsigned char *src;
+char *ret,*dest;
+unsigned int n=0;
+
+for (src=(unsigned char *)name;*src;src++) {
+	unsigned int ui=*src;
+	if (((ui>='a')&&(ui<='z')) || ((ui>='A')&&(ui<='Z')) || ((ui>='0')&&(ui<='9')) || (ui=='.') || (ui=='_') || (ui=='-')) {
+		n+=1;
+	} else {
+		n+=3;
+	}
+}
+if (n>MAXNAME_SHARDS_BITROT) {
+	unsigned char md5[LEN_MD5_BITROT];
+	if (md5string(md5,name)) return NULL;
+	if (!(ret=malloc(2+LEN_MD5_BITROT*2+5))) return NULL;
+	memcpy(ret,"h-",2);
+	(void)sethexbuff((unsigned char *)ret+2,md5,LEN_MD5_BITROT);
+	strcpy(ret+2+LEN_MD5_BITROT*2,".md5");
+	return ret;
+}
+if (!(ret=malloc(2+n+5))) return NULL;
+dest=ret;
+*dest++='d';
+*dest++='-';
+for (src=(unsigned char *)name;*src;src++) {
+	unsigned int ui=*src;
+	if (((ui>='a')&&(ui<='z')) || ((ui>='A')&&(ui<='Z')) || ((ui>='0')&&(ui<='9')) || (ui=='.') || (ui=='_') || (ui=='-')) {
+		*dest++=ui;
+	} else {
+		*dest++='%';
+		*dest++=hexvals[ui>>4];
+		*dest++=hexvals[ui&15];
+	}
+}
+strcpy(dest,".md5");
+return ret;
+}
+
+static char *pathshard(char *dirname, char *name) {
+char *ret;
+if (!(ret=malloc(strlen(dirname)+1+strlen(name)+1))) return NULL;
+sprintf(ret,"%s/%s",dirname,name);
+return ret;
+}
+
+struct loadshard_bitrot {
+	char *filename;
+	char *name; // within filename, as listed in the manifest
+	int isroot;
+	struct dir_bitrot *dir; // filled in by the loader for directory shards
+	struct blockmem *blockmem;
+	uint64_t mtime;
+};
+
+struct loadshards_bitrot {
+	struct bitrot *b;
+	struct loadshard_bitrot *list;
+	unsigned int count,max;
+};
+
+static int loadshard(void *arg, unsigned int i) {
+// each shard has its own blockmem and its own top-level directory, so these can run in parallel
+struct loadshards_bitrot *ls=arg;
+struct loadshard_bitrot *shard=&ls->list[i];
+struct cursor_bitrot cursor;
+FILE *ff=NULL;
+char *oneline=NULL;
+
+cursor.top=NULL;
+
+if (!(ff=fopen(shard->filename,"r"))) {
+	fprintf(stderr,"%s:%d error opening shard %s (%s)\n",__FILE__,__LINE__,shard->filename,strerror(errno));
+	GOTOERROR;
+}
+{
+	struct stat statbuf;
+	if (fstat(fileno(ff),&statbuf)) GOTOERROR;
+#ifdef LINUX
+	shard->mtime=statbuf.st_mtim.tv_sec;
+#elif OSX
+	shard->mtime=statbuf.st_mtimespec.tv_sec;
+#endif 
+}
+if (!(oneline=malloc(MAXLINELEN))) GOTOERROR;
+while (1) {
+	unsigned char buff16[LEN_MD5_BITROT];
+	char *path,*slash;
+	if (!fgets(oneline,MAXLINELEN,ff)) break;
+	if (parsesumline(&path,buff16,oneline,shard->filename)) GOTOERROR;
+	if (!path) continue;
+	if (ls->b->options.subtree && !isinsubtree(path,ls->b->options.subtree)) continue;
+	slash=strchr(path,'/');
+	if (shard->isroot) {
+		if (slash) {
+			fprintf(stderr,"%s:%d entry doesn't belong in %s, \"%s\"\n",__FILE__,__LINE__,shard->filename,path);
+			GOTOERROR;
+		}
+		if (addfileentry2(&cursor,shard->blockmem,&ls->b->topdir,path,buff16,0)) GOTOERROR;
+		continue;
+	}
+	if (!slash || (slash==path)) {
+		fprintf(stderr,"%s:%d entry doesn't belong in %s, \"%s\"\n",__FILE__,__LINE__,shard->filename,path);
+		GOTOERROR;
+	}
+	*slash='\0';
+	if (!shard->dir) { // linked into topdir by the caller, once all the threads are done
+		struct dir_bitrot *dir;
+		if (!(dir=ALLOC_blockmem(shard->blockmem,struct dir_bitrot))) GOTOERROR;
+		clear_dir_bitrot(dir);
+		if (!(dir->name=strdup_blockmem(shard->blockmem,path))) GOTOERROR;
+		dir->parent=&ls->b->topdir;
+		dir->flags=ISINFILE_FLAG_BITROT|ISSHARD_FLAG_BITROT;
+		shard->dir=dir;
+	} else if (strcmp(shard->dir->name,path)) {
+		*slash='/';
+		fprintf(stderr,"%s:%d entry doesn't belong in %s, \"%s\"\n",__FILE__,__LINE__,shard->filename,path);
+		GOTOERROR;
+	}
+	if (addfileentry2(&cursor,shard->blockmem,shard->dir,slash+1,buff16,0)) GOTOERROR;
+}
+if (ferror(ff)) GOTOERROR;
+free(oneline);
+fclose(ff);
+return 0;
+error:
+	iffree(oneline);
+	iffclose(ff);
+	return -1;
+}
+
+static char *subtreeshard(char *subtree) {
+// the shard holding --subtree
+char *slash,*ret;
+slash=strchr(subtree,'/');
+if (slash) *slash='\0';
+ret=shardname(subtree);
+if (slash) *slash='/';
+return ret;
+}
+
+int loadshards_bitrot(int *isnotfound_out, struct bitrot *b, char *dirname) {
+struct loadshards_bitrot ls;
+FILE *ff=NULL;
+char *oneline=NULL;
+char *manifest=NULL;
+char *onlyshard=NULL;
+unsigned int i;
+int isroot=0;
+
+memset(&ls,0,sizeof(ls));
+ls.b=b;
+if (!(b->shards.dirname=strdup_blockmem(&b->blockmem,dirname))) GOTOERROR;
+if (b->options.subtree) {
+	if (!(onlyshard=subtreeshard(b->options.subtree))) GOTOERROR;
+}
+
+if (!(manifest=pathshard(dirname,MANIFEST_SHARDS_BITROT))) GOTOERROR;
+if (!(ff=fopen(manifest,"r"))) {
+	if (errno==ENOENT) {
+		free(manifest);
+		*isnotfound_out=1;
+		return 0;
+	}
+	fprintf(stderr,"%s:%d error opening %s (%s)\n",__FILE__,__LINE__,manifest,strerror(errno));
+	GOTOERROR;
+}
+if (!(oneline=malloc(MAXLINELEN))) GOTOERROR;
+if (!fgets(oneline,MAXLINELEN,ff) || strcmp(oneline,HEADER_SHARDS_BITROT)) {
+	fprintf(stderr,"%s:%d %s is not a shard manifest\n",__FILE__,__LINE__,manifest);
+	GOTOERROR;
+}
+while (1) {
+	struct loadshard_bitrot *shard;
+	unsigned int n;
+	if (!fgets(oneline,MAXLINELEN,ff)) break;
+	n=strlen(oneline);
+	if (!n || (oneline[n-1]!='\n')) {
+		fprintf(stderr,"%s:%d input line is too long in %s\n",__FILE__,__LINE__,manifest);
+		GOTOERROR;
+	}
+	n--;
+	oneline[n]='\0';
+	if (!n || (oneline[0]=='#')) continue;
+	if (strchr(oneline,'/') || (n<=4) || strcmp(oneline+n-4,".md5")) {
+		fprintf(stderr,"%s:%d bad shard name in %s, \"%s\"\n",__FILE__,__LINE__,manifest,oneline);
+		GOTOERROR;
+	}
+	if (onlyshard) {
+		if (strcmp(oneline,onlyshard)) continue;
+		if (b->shards.issubtree) continue;
+		b->shards.issubtree=1;
+	}
+	if (ls.count==ls.max) {
+		struct loadshard_bitrot *temp;
+		unsigned int newmax;
+		newmax=ls.max*2+64;
+		if (!(temp=realloc(ls.list,newmax*sizeof(struct loadshard_bitrot)))) GOTOERROR;
+		ls.list=temp;
+		ls.max=newmax;
+	}
+	shard=&ls.list[ls.count];
+	memset(shard,0,sizeof(struct loadshard_bitrot));
+	if (!(shard->filename=pathshard(dirname,oneline))) GOTOERROR;
+	ls.count+=1;
+	shard->name=shard->filename+strlen(dirname)+1;
+	if (!strcmp(oneline,ROOT_SHARDS_BITROT)) {
+		if (isroot) { // two threads can't both fill topdir
+			fprintf(stderr,"%s:%d duplicate shard in %s, \"%s\"\n",__FILE__,__LINE__,manifest,oneline);
+			GOTOERROR;
+		}
+		isroot=1;
+		shard->isroot=1;
+	}
+}
+if (ferror(ff)) GOTOERROR;
+free(oneline);
+oneline=NULL;
+fclose(ff);
+ff=NULL;
+
+if (ls.count) {
+	if (!(b->shards.blockmems=calloc(ls.count,sizeof(struct blockmem)))) GOTOERROR;
+	b->shards.count=ls.count;
+	for (i=0;i<ls.count;i++) {
+		(void)voidinit_blockmem(&b->shards.blockmems[i]);
+		ls.list[i].blockmem=&b->shards.blockmems[i];
+	}
+}
+
+if (runjobs(b->options.threads,ls.count,loadshard,&ls)) GOTOERROR;
+
+for (i=0;i<ls.count;i++) {
+	struct loadshard_bitrot *shard=&ls.list[i];
+	char *expected;
+	int r;
+	if (shard->mtime>b->sumfile.mtime) b->sumfile.mtime=shard->mtime;
+	if (shard->isroot) {
+		b->topdir.flags|=ISSHARD_FLAG_BITROT;
+		continue;
+	}
+	if (!shard->dir) continue; // empty
+	if (!(expected=shardname(shard->dir->name))) GOTOERROR;
+	r=strcmp(expected,shard->name);
+	free(expected);
+	if (r) { // the name is how we find it again to replace or remove it
+		fprintf(stderr,"%s:%d shard %s has entries for \"%s\"\n",__FILE__,__LINE__,shard->filename,shard->dir->name);
+		GOTOERROR;
+	}
+	if (filename_find2_dirbyname(b->topdir.children.topnode,shard->dir->name)) {
+		fprintf(stderr,"%s:%d duplicate shard %s\n",__FILE__,__LINE__,shard->filename);
+		GOTOERROR;
+	}
+	(void)addnode2_dirbyname(&b->topdir.children.topnode,shard->dir);
+}
+
+for (i=0;i<ls.count;i++) free(ls.list[i].filename);
+free(ls.list);
+free(manifest);
+iffree(onlyshard);
+*isnotfound_out=0;
+return 0;
+error:
+	iffree(oneline);
+	iffclose(ff);
+	for (i=0;i<ls.count;i++) iffree(ls.list[i].filename);
+	iffree(ls.list);
+	iffree(manifest);
+	iffree(onlyshard);
+	return -1;
+}
+
+struct writeshard_bitrot {
+	char *name;
+	char *filename;
+	struct dir_bitrot *dir;
+	unsigned int status;
+	int isroot;
+	int isrewrite;
+};
+
+static int writeshard(void *arg, unsigned int i) {
+struct writeshard_bitrot *shard=(struct writeshard_bitrot *)arg+i;
+struct writer_bitrot w;
+char *tempname=NULL;
+int fd=-1;
+
+if (!shard->isrewrite) return 0;
+clear_writer_bitrot(&w);
+if (opentemp(&fd,&tempname,shard->filename)) GOTOERROR;
+if (init_writer(&w,fd)) GOTOERROR;
+if (shard->isroot) {
+	if (writefiles_writer(&w,shard->dir->files.topnode)) GOTOERROR;
+} else {
+	if (writeone_writer(&w,shard->dir)) GOTOERROR;
+}
+if (flush_writer(&w)) GOTOERROR;
+fd=-1;
+if (committemp(w.fd,tempname,shard->filename)) GOTOERROR;
+deinit_writer(&w);
+free(tempname);
+return 0;
+error:
+	deinit_writer(&w);
+	ifclose(fd);
+	if (tempname) {
+		(ignore)unlink(tempname);
+		free(tempname);
+	}
+	return -1;
+}
+
+static int addtext_writer(struct writer_bitrot *w, char *text) {
+// text and a newline
+unsigned int n;
+n=strlen(text);
+if (reserve_writer(w,n+1)) GOTOERROR;
+memcpy(w->buffer+w->num,text,n);
+w->buffer[w->num+n]='\n';
+w->num+=n+1;
+return 0;
+error:
+	return -1;
+}
+
+static int writemanifest(char *filename, struct writeshard_bitrot *list, unsigned int count) {
+struct writer_bitrot w;
+char *tempname=NULL;
+int fd=-1;
+unsigned int i;
+
+clear_writer_bitrot(&w);
+if (opentemp(&fd,&tempname,filename)) GOTOERROR;
+if (init_writer(&w,fd)) GOTOERROR;
+if (writen_bitrot(fd,(unsigned char *)HEADER_SHARDS_BITROT,strlen(HEADER_SHARDS_BITROT))) GOTOERROR;
+for (i=0;i<count;i++) {
+	if (!(list[i].status&HASFOUND_SHARD_BITROT)) continue;
+	if (addtext_writer(&w,list[i].name)) GOTOERROR;
+}
+if (flush_writer(&w)) GOTOERROR;
+fd=-1;
+if (committemp(w.fd,tempname,filename)) GOTOERROR;
+deinit_writer(&w);
+free(tempname);
+return 0;
+error:
+	deinit_writer(&w);
+	ifclose(fd);
+	if (tempname) {
+		(ignore)unlink(tempname);
+		free(tempname);
+	}
+	return -1;
+}
+
+static int updatemanifest(char *filename, char *name, int isadd) {
+// --subtree: adds or removes one shard, the rest of the manifest is copied
+struct writer_bitrot w;
+struct timespec mtime={0,0};
+FILE *ff=NULL;
+char *oneline=NULL,*tempname=NULL;
+int ismtime=0;
+int fd=-1;
+
+clear_writer_bitrot(&w);
+if (opentemp(&fd,&tempname,filename)) GOTOERROR;
+if (init_writer(&w,fd)) GOTOERROR;
+if (writen_bitrot(fd,(unsigned char *)HEADER_SHARDS_BITROT,strlen(HEADER_SHARDS_BITROT))) GOTOERROR;
+if (!(ff=fopen(filename,"r"))) {
+	if (errno!=ENOENT) GOTOERROR;
+} else {
+	struct stat statbuf;
+	if (fstat(fileno(ff),&statbuf)) GOTOERROR;
+	(void)getmtime_stat(&mtime,&statbuf);
+	ismtime=1;
+	if (!(oneline=malloc(MAXLINELEN))) GOTOERROR;
+	if (!fgets(oneline,MAXLINELEN,ff) || strcmp(oneline,HEADER_SHARDS_BITROT)) {
+		fprintf(stderr,"%s:%d %s is not a shard manifest\n",__FILE__,__LINE__,filename);
+		GOTOERROR;
+	}
+	while (1) {
+		unsigned int n;
+		if (!fgets(oneline,MAXLINELEN,ff)) break;
+		n=strlen(oneline);
+		if (!n || (oneline[n-1]!='\n')) {
+			fprintf(stderr,"%s:%d input line is too long in %s\n",__FILE__,__LINE__,filename);
+			GOTOERROR;
+		}
+		oneline[n-1]='\0';
+		if (!strcmp(oneline,name)) continue;
+		if (isadd && !strcmp(oneline,ROOT_SHARDS_BITROT)) { // top-level files stay last
+			if (addtext_writer(&w,name)) GOTOERROR;
+			isadd=0;
+		}
+		if (addtext_writer(&w,oneline)) GOTOERROR;
+	}
+	if (ferror(ff)) GOTOERROR;
+	fclose(ff);
+	ff=NULL;
+}
+if (isadd) {
+	if (addtext_writer(&w,name)) GOTOERROR;
+}
+if (flush_writer(&w)) GOTOERROR;
+if (ismtime) {
+	if (keepmtime(w.fd,&mtime)) GOTOERROR;
+}
+fd=-1;
+if (committemp(w.fd,tempname,filename)) GOTOERROR;
+deinit_writer(&w);
+free(tempname);
+iffree(oneline);
+return 0;
+error:
+	deinit_writer(&w);
+	iffclose(ff);
+	ifclose(fd);
+	if (tempname) {
+		(ignore)unlink(tempname);
+		free(tempname);
+	}
+	iffree(oneline);
+	return -1;
+}
+
+static int writesubtreeshard(struct bitrot *b) {
+// the subtree is spliced into its shard, other shards aren't loaded
+char *dirname=b->shards.dirname;
+char *name=NULL,*filename=NULL,*manifest=NULL;
+int isempty;
+
+if (!(name=subtreeshard(b->options.subtree))) GOTOERROR;
+if (!(filename=pathshard(dirname,name))) GOTOERROR;
+if (!(manifest=pathshard(dirname,MANIFEST_SHARDS_BITROT))) GOTOERROR;
+if (splicefile(&isempty,b,filename)) GOTOERROR;
+if (isempty) {
+	if (b->shards.issubtree) {
+		if (updatemanifest(manifest,name,0)) GOTOERROR;
+	}
+	if (unlink(filename)) GOTOERROR;
+} else if (!b->shards.issubtree) {
+	if (updatemanifest(manifest,name,1)) GOTOERROR;
+}
+free(name);
+free(filename);
+free(manifest);
+return 0;
+error:
+	iffree(name);
+	iffree(filename);
+	iffree(manifest);
+	return -1;
+}
+
+int writeshards_bitrot(struct bitrot *b) {
+// only shards with changes are rewritten, the manifest only if shards come or go
+struct segments_bitrot segs;
+struct writeshard_bitrot *list=NULL;
+char *dirname=b->shards.dirname;
+char *manifest=NULL;
+unsigned int i,count=0;
+int ismanifest=0;
+
+memset(&segs,0,sizeof(segs));
+if (mkdir(dirname,0777)) {
+	if (errno!=EEXIST) {
+		fprintf(stderr,"%s:%d error creating %s (%s)\n",__FILE__,__LINE__,dirname,strerror(errno));
+		GOTOERROR;
+	}
+}
+if (b->options.subtree) {
+	if (writesubtreeshard(b)) GOTOERROR;
+	return 0;
+}
+if (b->topdir.children.topnode) {
+	if (addsegments(&segs,b->topdir.children.topnode)) GOTOERROR;
+}
+if (!(list=calloc(segs.count+1,sizeof(struct writeshard_bitrot)))) GOTOERROR;
+for (i=0;i<=segs.count;i++) {
+	struct writeshard_bitrot *shard=&list[i];
+	struct dir_bitrot *dir;
+	count+=1;
+	if (i==segs.count) { // top-level files go last, like the sumfile
+		dir=&b->topdir;
+		shard->isroot=1;
+		if (dir->files.topnode) shard->status=filesstatus(dir->files.topnode);
+		if (!(shard->name=strdup(ROOT_SHARDS_BITROT))) GOTOERROR;
+	} else {
+		dir=segs.list[i].dir;
+		if (dir->children.topnode) shard->status=dirstatus(dir->children.topnode);
+		if (dir->files.topnode) shard->status|=filesstatus(dir->files.topnode);
+		if (!(shard->name=shardname(dir->name))) GOTOERROR;
+	}
+	shard->dir=dir;
+	if (!(shard->filename=pathshard(dirname,shard->name))) GOTOERROR;
+	if (shard->status&HASFOUND_SHARD_BITROT) {
+		if (!(dir->flags&ISSHARD_FLAG_BITROT)) {
+			ismanifest=1;
+			shard->isrewrite=1;
+		} else if (shard->status&ISDIRTY_SHARD_BITROT) {
+			shard->isrewrite=1;
+		}
+	} else if (dir->flags&ISSHARD_FLAG_BITROT) {
+		ismanifest=1;
+	}
+}
+
+// new shards have to exist before the manifest lists them
+if (runjobs(b->options.threads,count,writeshard,list)) GOTOERROR;
+
+if (ismanifest) {
+	if (!(manifest=pathshard(dirname,MANIFEST_SHARDS_BITROT))) GOTOERROR;
+	if (writemanifest(manifest,list,count)) GOTOERROR;
+	for (i=0;i<count;i++) {
+		struct writeshard_bitrot *shard=&list[i];
+		if (shard->status&HASFOUND_SHARD_BITROT) continue;
+		if (!(shard->dir->flags&ISSHARD_FLAG_BITROT)) continue;
+		if (unlink(shard->filename)) {
+			if (errno!=ENOENT) GOTOERROR;
+		}
+	}
+	free(manifest);
+}
+
+for (i=0;i<count;i++) {
+	iffree(list[i].name);
+	iffree(list[i].filename);
+}
+free(list);
+iffree(segs.list);
+return 0;
+error:
+	if (list) {
+		for (i=0;i<count;i++) {
+			iffree(list[i].name);
+			iffree(list[i].filename);
+		}
+		free(list);
+	}
+	iffree(segs.list);
+	iffree(manifest);
+	return -1;
+}
+
+static int printdirtree(struct dir_bitrot *dir, int depth, FILE *fout) {
+if (dir->treevars.left) {
+	(ignore)printdirtree(dir->treevars.left,depth,fout);
+}
+int i;
+for (i=0;i<depth;i++) fputc(' ',fout);
+fputs(dir->name,fout);
+fputc('\n',fout);
+if (dir->children.topnode) printdirtree(dir->children.topnode,depth+1,fout);
+
+if (dir->treevars.right) {
+	(ignore)printdirtree(dir->treevars.right,depth,fout);
+}
+return 0;
+}
+
+int printtree_bitrot(struct bitrot *b, FILE *fout) {
+// TODO handle errors
+struct dir_bitrot *dir;
+
+dir=&b->topdir;
+(ignore)printdirtree(dir,1,fout);
+return 0;
+}
+
+static void unprintprogress(struct bitrot *b) {
+char *line;
+int n;
+
+if (!b->progress.isprinted) return;
+b->progress.isprinted=0;
+
+n=b->progress.linelength;
+line=b->progress.line;
+
+memset(line,' ',n);
+line[n]='\r';
+
+(ignore)fwrite(line,n+1,1,stderr);
+}
+static void printprogress(struct bitrot *b, int ismd5, char *name) {
+// scantar used to need x<=100 in strnlen(name,x)
+char *line;
+unsigned int n,m,columns;
+time_t t;
+
+t=time(NULL);
+if (b->progress.isprinted) {
+	if (t<b->progress.nextupdate) return;
+	(void)unprintprogress(b); // this could exceed columns if we had a resize but we have races there anyway
+}
+b->progress.isprinted=1;
+b->progress.nextupdate=t+1;
+
+line=b->progress.line;
+
+n=snprintf(line,MAX_LINE_PROGRESS_BITROT+1,"bitrot: %"PRIu64"MB %s",b->stats.bytesprocessed/(1024*1024),ismd5?"+ ":"- ");
+if (n>=MAX_LINE_PROGRESS_BITROT) return;
+
+#if 0
+unsigned int space;
+m=strnlen(name,100); // need 100 limit for tar
+space=MAX_LINE_PROGRESS_BITROT-n;
+if (m>space) m=space;
+#endif
+m=strnlen(name,MAX_LINE_PROGRESS_BITROT-n); // no limit needed now
+
+memcpy(line+n,name,m);
+n+=m;
+
+{
+	struct winsize ws;
+	if (!ioctl(STDERR_FILENO,TIOCGWINSZ,&ws)) {
+		columns=ws.ws_col;
+		if (columns>2) columns-=2;
+	} else {
+		columns=78;
+	}
+}
+
+n=_BADMIN(n,columns);
+b->progress.linelength=n;
+line[n]='\r'; // we have +1 allocated
+
+(ignore)fwrite(line,n+1,1,stderr);
+}
+void unprintprogress_bitrot(struct bitrot *b) {
+unprintprogress(b);
+}
+
+#ifdef USEMMAP
+#ifdef OPENSSL
+static int getmd5_mmap(int *isnommap_out, MD5_CTX *ctx, int fd, uint64_t st_size, unsigned int readusleep) {
+#else
+static void getmd5_mmap(int *isnommap_out, MD5_CTX *ctx, int fd, uint64_t st_size, unsigned int readusleep) {
+#endif
+unsigned char *ptr;
+struct mmapwrapper mw;
+uint64_t left;
+
+clear_mmapwrapper(&mw);
+
+#if UINTPTR_MAX == 0xffffffff
+#warning compiling for 32bit pointers
+if (st_size>0xff000000) { // on 32bit machines, we fall back on read() for files that don't fit
+// TODO manage 32bit allocations of mmap
+	*isnommap_out=1;
+#ifdef OPENSSL
+	return 0;
+#else
+	return;
+#endif
+}
+#endif
+
+if (initreadfd2_mmapwrapper(&mw,fd,st_size)) { // can only fail by mmap
+	*isnommap_out=1;
+#ifdef OPENSSL
+	return 0;
+#else
+	return;
+#endif
+}
+
+{
+	ptr=mw.addr;
+	left=mw.filesize;
+
+	while (1) {
+		if (!left) break;
+		if (left>READCHUNK_BITROT) {
+#ifdef OPENSSL
+			if (1!=MD5_Update(ctx,ptr,READCHUNK_BITROT)) GOTOERROR;
+#elif GNUTLS
+			(void)MD5_Update(ctx,ptr,READCHUNK_BITROT);
+#else
+			(void)addbytes_context_md5(ctx,ptr,READCHUNK_BITROT);
+#endif
+			ptr+=READCHUNK_BITROT;
+			left-=READCHUNK_BITROT;
+		} else {
+			int k;
+			k=left;
+#ifdef OPENSSL
+			if (1!=MD5_Update(ctx,ptr,k)) GOTOERROR;
+#elif GNUTLS
+			(void)MD5_Update(ctx,ptr,k);
+#else
+			(void)addbytes_context_md5(ctx,ptr,k);
+#endif
+			break;
+		}
+		if (readusleep) usleep(readusleep);
+	}
+}
+
+*isnommap_out=0;
+deinit_mmapwrapper(&mw);
+#ifdef OPENSSL
+return 0;
+error:
+	deinit_mmapwrapper(&mw);
+	return -1;
+#endif
+}
+// end USEMMAP
+#endif
+
+#ifdef SEEK_HOLE
+#if defined OPENSSL || defined GNUTLS
+static unsigned char zeros_sparse[READCHUNK_BITROT];
+#endif
+static int getmd5_sparse(MD5_CTX *ctx, int fd, uint64_t st_size, unsigned char *iobuffer, unsigned int iobuffermax,
+		unsigned int readusleep) {
+// holes are hashed as zeros without reading them
+uint64_t offset=0;
+while (offset<st_size) {
+	off_t data,hole;
+	data=lseek(fd,offset,SEEK_DATA);
+	if (data<0) {
+		if (errno!=ENXIO) GOTOERROR;
+		data=st_size; // a hole to the end
+	}
+	if ((uint64_t)data>st_size) data=st_size;
+	if ((uint64_t)data>offset) {
+		uint64_t len=data-offset;
+#if defined OPENSSL || defined GNUTLS
+		while (len) {
+			unsigned int k;
+			k=_BADMIN(len,READCHUNK_BITROT);
+#ifdef OPENSSL
+			if (1!=MD5_Update(ctx,zeros_sparse,k)) GOTOERROR;
+#else
+			(void)MD5_Update(ctx,zeros_sparse,k);
+#endif
+			len-=k;
+		}
+#else
+		(void)addzeros_context_md5(ctx,len);
+#endif
+		offset=data;
+	}
+	if (offset==st_size) break;
+	hole=lseek(fd,data,SEEK_HOLE);
+	if (hole<0) GOTOERROR;
+	if ((uint64_t)hole>st_size) hole=st_size;
+	while (offset<(uint64_t)hole) {
+		ssize_t k;
+		k=pread(fd,iobuffer,_BADMIN(hole-offset,iobuffermax),offset);
+		if (k<=0) {
+			if (!k) return 0; // truncated while we were reading
+			if (errno==EINTR) continue;
+			GOTOERROR;
+		}
+#ifdef OPENSSL
+		if (1!=MD5_Update(ctx,iobuffer,k)) GOTOERROR;
+#elif GNUTLS
+		(void)MD5_Update(ctx,iobuffer,k);
+#else
+		(void)addbytes_context_md5(ctx,iobuffer,k);
+#endif
+		offset+=k;
+		if (readusleep) usleep(readusleep);
+	}
+}
+return 0;
+error:
+	return -1;
+}
+#endif
+
+static int getmd5B(int *isnofile_out, unsigned char *iobuffer, unsigned int iobuffermax, unsigned int readusleep,
+		unsigned int smallfilemax, unsigned char *dest, int dfd, char *name, uint64_t st_size) {
+// iobuffer is for small files and when mmap isn't available, hashing threads each have their own
+MD5_CTX ctx;
+unsigned char *ptr;
+unsigned int ptrmax;
+int fd=-1;
+
+if (!st_size) {
+	memcpy(dest,zeromd5,16);
+} else {
+	int isnommap,issparse=0;
+#ifdef OPENSSL
+	if (1!=MD5_Init(&ctx)) GOTOERROR; // probably can't happen
+#elif GNUTLS
+	(void)MD5_Init(&ctx);
+#else
+	(void)clear_context_md5(&ctx);
+#endif
+	fd=openat(dfd,name,O_RDONLY);
+	if (0>fd) {
+		if ((errno==EACCES) || (errno==EPERM)) {
+			*isnofile_out=1;
+			return 0;
+		}
+		fprintf(stderr,"%s:%d error opening %s, (%s)\n",__FILE__,__LINE__,name,strerror(errno));
+		GOTOERROR;
+	}
+
+#ifdef SEEK_HOLE
+	if (st_size>READCHUNK_BITROT) { // only worth a syscall if there's room for a hole
+		off_t hole;
+		hole=lseek(fd,0,SEEK_HOLE);
+		if ((hole>=0) && ((uint64_t)hole<st_size)) {
+			issparse=1;
+		} else {
+			if (0>lseek(fd,0,SEEK_SET)) GOTOERROR;
+		}
+	}
+#endif
+	if (issparse) {
+#ifdef SEEK_HOLE
+		if (getmd5_sparse(&ctx,fd,st_size,iobuffer,iobuffermax,readusleep)) GOTOERROR;
+#endif
+		isnommap=0;
+	} else if ((st_size<=smallfilemax) && (st_size<=iobuffermax)) { // one read() is cheaper than mmap and munmap
+		ssize_t k;
+		k=read(fd,iobuffer,st_size);
+		if (k<0) GOTOERROR;
+#ifdef OPENSSL
+		if (1!=MD5_Update(&ctx,iobuffer,k)) GOTOERROR;
+#elif GNUTLS
+		(void)MD5_Update(&ctx,iobuffer,k);
+#else
+		(void)addbytes_context_md5(&ctx,iobuffer,k);
+#endif
+		isnommap=(k!=st_size); // short read, the loop below gets the rest
+	} else {
+#ifdef USEMMAP
+#ifdef OPENSSL
+		if (getmd5_mmap(&isnommap,&ctx,fd,st_size,readusleep)) GOTOERROR;
+#else
+		(void)getmd5_mmap(&isnommap,&ctx,fd,st_size,readusleep);
+#endif
+#else
+		isnommap=1;
+#endif
+	}
+	if (isnommap) {
+		ptr=iobuffer;
+		ptrmax=iobuffermax;
+
+		while (1) {
+			int k;
+			k=read(fd,ptr,ptrmax);
+			if (k<=0) {
+				if (!k) break;
+				GOTOERROR;
+			}
+#ifdef OPENSSL
+			if (1!=MD5_Update(&ctx,ptr,k)) GOTOERROR;
+#elif GNUTLS
+			(void)MD5_Update(&ctx,ptr,k);
+#else
+			(void)addbytes_context_md5(&ctx,ptr,k);
+#endif
+			if (readusleep) usleep(readusleep);
+		}
+	}
+
+#ifdef OPENSSL
+	if (1!=MD5_Final(dest,&ctx)) GOTOERROR;
+#elif GNUTLS
+	(void)MD5_Final(dest,&ctx);
+#else
+	(void)finish_context_md5(dest,&ctx);
+#endif
+	(ignore)close(fd);
+}
+
+*isnofile_out=0;
+return 0;
+error:
+	ifclose(fd);
+	return -1;
+}
+
+static int getmd5(int *isnofile_out, struct bitrot *b, unsigned char *dest, int dfd, char *name, uint64_t st_size) {
+return getmd5B(isnofile_out,b->iobuffer.ptr,b->iobuffer.ptrmax,b->options.readusleep,b->options.smallfilemax,
+		dest,dfd,name,st_size);
+}
+
+static int printentry(struct bitrot *b, char *msg, struct dir_bitrot *db, char *name) {
+FILE *msgout=b->options.msgout;
+(void)unprintprogress(b);
+if (0>fputs(msg,msgout)) GOTOERROR;
+if (printpath(db,msgout)) GOTOERROR;
+if (0>fputs(name,msgout)) GOTOERROR;
+if (0>fputc('\n',msgout)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+static int comparefile(struct bitrot *b, struct dir_bitrot *db, struct file_bitrot *file, char *name,
+		unsigned char *md5, uint64_t mtime) {
+// file is known, md5 is what we just read
+file->flags|=ISFOUND_FLAG_BITROT;
+if (memcmp(md5,file->md5,LEN_MD5_BITROT)) {
+	int issave=0;
+	file->flags|=ISMISMATCH_FLAG_BITROT;
+	if (mtime>=b->sumfile.mtime) { // if the mtime is updated, the file changing is not odd
+		issave=1;
+		if (b->options.isverbose) {
+			if (printentry(b,"file changed: ",db,name)) GOTOERROR;
+		}
+	} else { // don't want to auto-update the md5 in case there was corruption
+		if (b->options.issavechanges) {
+			issave=1; 
+			if (printentry(b,"Updating new MD5: ",db,name)) GOTOERROR;
+		} else {
+			if (printentry(b,"MD5 has changed: ",db,name)) GOTOERROR;
+		}
+	}
+	if (issave) {
+		memcpy(file->md5,md5,LEN_MD5_BITROT);
+		file->flags|=ISCHANGED_FLAG_BITROT;
+		b->stats.changecount+=1;
+	}
+} else {
+	file->flags|=ISMATCHED_FLAG_BITROT;
+	if (b->options.isverbose) {
+		if (printentry(b,"matched: ",db,name)) GOTOERROR;
+	}
+}
+return 0;
+error:
+	return -1;
+}
+
+static int setkey(struct keyed_bitrot **root_inout, struct blockmem *blockmem, uint64_t key1, uint64_t key2,
+		unsigned char *md5) {
+struct keyed_bitrot *k;
+k=key_find2_bykey(*root_inout,key1,key2);
+if (!k) {
+	if (!(k=ALLOC_blockmem(blockmem,struct keyed_bitrot))) GOTOERROR;
+	clear_keyed_bitrot(k);
+	k->key1=key1;
+	k->key2=key2;
+	(void)addnode2_bykey(root_inout,k);
+}
+if (md5) memcpy(k->md5,md5,LEN_MD5_BITROT);
+return 0;
+error:
+	return -1;
+}
+
+struct meta_bitrot {
+	mode_t mode;
+	uint64_t size,mtime;
+	dev_t dev;
+	uint64_t ino;
+	uint64_t nlink;
+};
+
+static int getmeta(struct meta_bitrot *meta, int dfd, char *name, int isfollow) {
+// only what the scan uses, statx doesn't have to fill in the rest
+#ifdef LINUX
+#ifdef STATX_TYPE
+struct statx stx;
+if (!statx(dfd,name,AT_STATX_SYNC_AS_STAT|(isfollow?0:AT_SYMLINK_NOFOLLOW),
+		STATX_TYPE|STATX_MODE|STATX_SIZE|STATX_MTIME|STATX_INO|STATX_NLINK,&stx)) {
+	meta->mode=stx.stx_mode;
+	meta->size=stx.stx_size;
+	meta->mtime=stx.stx_mtime.tv_sec;
+	meta->dev=makedev(stx.stx_dev_major,stx.stx_dev_minor);
+	meta->ino=stx.stx_ino;
+	meta->nlink=stx.stx_nlink;
+	return 0;
+}
+if (errno!=ENOSYS) return -1; // old kernels fall through to fstatat
+#endif
+#endif
+{
+	struct stat statbuf;
+	if (fstatat(dfd,name,&statbuf,isfollow?0:AT_SYMLINK_NOFOLLOW)) return -1;
+	meta->mode=statbuf.st_mode;
+	meta->size=statbuf.st_size;
+#ifdef LINUX
+	meta->mtime=statbuf.st_mtim.tv_sec;
+#elif OSX
+	meta->mtime=statbuf.st_mtimespec.tv_sec;
+#endif
+	meta->dev=statbuf.st_dev;
+	meta->ino=statbuf.st_ino;
+	meta->nlink=statbuf.st_nlink;
+}
+return 0;
+}
+
+static int fingerprint_extents(int *isshared_out, uint64_t *key1_out, uint64_t *key2_out, struct bitrot *b,
+		int dfd, char *name, uint64_t size) {
+// md5 of the extent map, the size and the first and last blocks, only if every extent is shared
+#ifdef LINUX
+unsigned char digest[LEN_MD5_BITROT];
+unsigned char *sample;
+struct fiemap *fm;
+MD5_CTX ctx;
+uint64_t start=0;
+unsigned int maxextents,count=0;
+int fd=-1,islast=0;
+
+*isshared_out=0;
+fd=openat(dfd,name,O_RDONLY);
+if (fd<0) return 0; // getmd5 will report it
+#ifdef OPENSSL
+if (1!=MD5_Init(&ctx)) GOTOERROR;
+if (1!=MD5_Update(&ctx,&size,sizeof(size))) GOTOERROR;
+#elif GNUTLS
+(void)MD5_Init(&ctx);
+(void)MD5_Update(&ctx,&size,sizeof(size));
+#else
+(void)clear_context_md5(&ctx);
+(void)addbytes_context_md5(&ctx,(unsigned char *)&size,sizeof(size));
+#endif
+fm=(struct fiemap *)b->iobuffer.ptr;
+maxextents=(b->iobuffer.ptrmax-sizeof(struct fiemap))/sizeof(struct fiemap_extent);
+while (!islast) {
+	unsigned int i;
+	memset(fm,0,sizeof(struct fiemap));
+	fm->fm_start=start;
+	fm->fm_length=FIEMAP_MAX_OFFSET-start;
+	fm->fm_flags=FIEMAP_FLAG_SYNC; // delalloc extents don't have an address yet
+	fm->fm_extent_count=maxextents;
+	if (ioctl(fd,FS_IOC_FIEMAP,fm)) goto notshared; // not supported by the filesystem
+	if (!fm->fm_mapped_extents) break;
+	for (i=0;i<fm->fm_mapped_extents;i++) {
+		struct fiemap_extent *fe=&fm->fm_extents[i];
+		uint64_t triple[3];
+		if (!(fe->fe_flags&FIEMAP_EXTENT_SHARED)) goto notshared;
+		// compressed extents report the same address for every slice, so they can't be compared
+		if (fe->fe_flags&(FIEMAP_EXTENT_UNKNOWN|FIEMAP_EXTENT_DELALLOC|FIEMAP_EXTENT_ENCODED
+				|FIEMAP_EXTENT_DATA_ENCRYPTED|FIEMAP_EXTENT_NOT_ALIGNED|FIEMAP_EXTENT_DATA_INLINE
+				|FIEMAP_EXTENT_DATA_TAIL|FIEMAP_EXTENT_UNWRITTEN)) goto notshared;
+		triple[0]=fe->fe_logical;
+		triple[1]=fe->fe_physical;
+		triple[2]=fe->fe_length;
+#ifdef OPENSSL
+		if (1!=MD5_Update(&ctx,triple,sizeof(triple))) GOTOERROR;
+#elif GNUTLS
+		(void)MD5_Update(&ctx,triple,sizeof(triple));
+#else
+		(void)addbytes_context_md5(&ctx,(unsigned char *)triple,sizeof(triple));
+#endif
+		count+=1;
+		start=fe->fe_logical+fe->fe_length;
+		if (fe->fe_flags&FIEMAP_EXTENT_LAST) islast=1;
+	}
+}
+if (!count) goto notshared;
+sample=b->iobuffer.ptr; // fm is done
+if (SAMPLE_EXTENTS_BITROT!=pread(fd,sample,SAMPLE_EXTENTS_BITROT,0)) goto notshared;
+if (SAMPLE_EXTENTS_BITROT!=pread(fd,sample+SAMPLE_EXTENTS_BITROT,SAMPLE_EXTENTS_BITROT,size-SAMPLE_EXTENTS_BITROT)) goto notshared;
+#ifdef OPENSSL
+if (1!=MD5_Update(&ctx,sample,2*SAMPLE_EXTENTS_BITROT)) GOTOERROR;
+if (1!=MD5_Final(digest,&ctx)) GOTOERROR;
+#elif GNUTLS
+(void)MD5_Update(&ctx,sample,2*SAMPLE_EXTENTS_BITROT);
+(void)MD5_Final(digest,&ctx);
+#else
+(void)addbytes_context_md5(&ctx,sample,2*SAMPLE_EXTENTS_BITROT);
+(void)finish_context_md5(digest,&ctx);
+#endif
+memcpy(key1_out,digest,8);
+memcpy(key2_out,digest+8,8);
+*isshared_out=1;
+notshared:
+(ignore)close(fd);
+return 0;
+#ifdef OPENSSL
+error:
+	ifclose(fd);
+	return -1;
+#endif
+#else
+*isshared_out=0;
+return 0;
+#endif
+}
+
+static int hashfile(int *isnofile_out, struct bitrot *b, unsigned char *md5, int dfd, char *name, struct meta_bitrot *meta) {
+// files that share an inode, or with --shared-extents all of their blocks, are only read once
+struct keyed_bitrot *k=NULL;
+uint64_t key1,key2;
+int isshared=0;
+int isnofile;
+
+if (meta->nlink>1) k=key_find2_bykey(b->hardlinks.inodes,meta->dev,meta->ino);
+if (!k && b->options.issharedextents && (meta->size>=MINSIZE_EXTENTS_BITROT)) {
+	if (fingerprint_extents(&isshared,&key1,&key2,b,dfd,name,meta->size)) GOTOERROR;
+	if (isshared) k=key_find2_bykey(b->sharedextents.fingerprints,key1,key2);
+}
+if (k) {
+	memcpy(md5,k->md5,LEN_MD5_BITROT);
+	if (b->options.isprogress) {
+		(void)printprogress(b,0,name);
+	}
+	*isnofile_out=0;
+	return 0;
+}
+if (b->options.isprogress) {
+	(void)printprogress(b,1,name);
+}
+if (getmd5(&isnofile,b,md5,dfd,name,meta->size)) GOTOERROR;
+b->stats.bytesprocessed+=meta->size;
+if (!isnofile) {
+	if (meta->nlink>1) {
+		if (setkey(&b->hardlinks.inodes,&b->blockmem,meta->dev,meta->ino,md5)) GOTOERROR;
+	}
+	if (isshared) {
+		if (setkey(&b->sharedextents.fingerprints,&b->blockmem,key1,key2,md5)) GOTOERROR;
+	}
+}
+*isnofile_out=isnofile;
+return 0;
+error:
+	return -1;
+}
+
+#ifdef LINUX
+struct dirent64_bitrot { // what SYS_getdents64 returns
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+struct entry_dents {
+	char *name;
+	uint64_t ino;
+	unsigned int type;
+	int isskip; // decided by the stat pass
+	uint64_t prefetched; // bytes asked for with WILLNEED, not yet hashed
+	struct file_bitrot *file;
+	struct meta_bitrot meta;
+};
+
+struct prefetch_dents {
+	unsigned int next; // first entry that hasn't been looked at
+	unsigned int pending; // prefetched and not yet hashed
+	uint64_t bytes;
+};
+
+struct dents_bitrot {
+	int fd;
+	unsigned int depth; // index into b->dents.buffers, which can move as deeper levels are added
+	int iseof;
+#ifndef LINUX
+	DIR *dir;
+#endif
+};
+
+static int init_dents(struct dents_bitrot *d, struct bitrot *b, int fd) {
+// consumes fd, even on error
+d->fd=fd;
+d->iseof=0;
+if (b->dents.depth==b->dents.count) {
+	struct dentsbuffer_bitrot *temp;
+	if (!(temp=realloc(b->dents.buffers,(b->dents.count+1)*sizeof(struct dentsbuffer_bitrot)))) GOTOERROR;
+	b->dents.buffers=temp;
+	memset(&temp[b->dents.count],0,sizeof(struct dentsbuffer_bitrot));
+	b->dents.count+=1;
+}
+d->depth=b->dents.depth;
+b->dents.depth+=1;
+#ifndef LINUX
+if (!(d->dir=fdopendir(fd))) {
+	b->dents.depth-=1;
+	GOTOERROR;
+}
+#endif
+return 0;
+error:
+	(ignore)close(fd);
+	d->fd=-1;
+	return -1;
+}
+
+static void deinit_dents(struct dents_bitrot *d, struct bitrot *b) {
+if (d->fd<0) return;
+b->dents.depth-=1;
+#ifdef LINUX
+(ignore)close(d->fd);
+#else
+(ignore)closedir(d->dir);
+#endif
+d->fd=-1;
+}
+
+static int reserve_dents(struct dentsbuffer_bitrot *db, unsigned int count) {
+if (count>db->entriesmax) {
+	void *temp;
+	unsigned int newmax;
+	newmax=count*2+64;
+	if (!(temp=realloc(db->entries,newmax*sizeof(struct entry_dents)))) GOTOERROR;
+	db->entries=temp;
+	db->entriesmax=newmax;
+}
+return 0;
+error:
+	return -1;
+}
+
+#ifdef LINUX
+static int cmpino_dents(const void *a, const void *b) {
+const struct entry_dents *ea=a,*eb=b;
+if (ea->ino<eb->ino) return -1;
+return (ea->ino>eb->ino);
+}
+#endif
+
+static int fill_dents(struct entry_dents **entries_out, unsigned int *count_out, struct dents_bitrot *d, struct bitrot *b) {
+// the next chunk of entries, sorted by inode on linux so the inode table is read in order
+struct dentsbuffer_bitrot *db=&b->dents.buffers[d->depth];
+struct entry_dents *entries;
+unsigned int count=0;
+#ifdef LINUX
+unsigned int num=0,offset;
+
+if (d->iseof) {
+	*count_out=0;
+	return 0;
+}
+if (!db->ptr) {
+	if (!(db->ptr=malloc(DENTSCHUNK_BITROT))) GOTOERROR;
+	db->ptrmax=DENTSCHUNK_BITROT;
+}
+while (1) { // as much of the directory as fits under MAXSORT_DENTS_BITROT
+	long k;
+	if (db->ptrmax-num<DENTSCHUNK_BITROT/2) {
+		unsigned char *temp;
+		unsigned int newmax;
+		if (db->ptrmax>=MAXSORT_DENTS_BITROT) break;
+		newmax=_BADMIN(db->ptrmax*2,MAXSORT_DENTS_BITROT);
+		if (!(temp=realloc(db->ptr,newmax))) GOTOERROR;
+		db->ptr=temp;
+		db->ptrmax=newmax;
+	}
+	k=syscall(SYS_getdents64,d->fd,db->ptr+num,db->ptrmax-num);
+	if (k<=0) {
+		if (!k) {
+			d->iseof=1;
+			break;
+		}
+		if (errno==EINTR) continue;
+		GOTOERROR;
+	}
+	num+=k;
+}
+for (offset=0;offset<num;) {
+	struct dirent64_bitrot *de;
+	char *name;
+	de=(struct dirent64_bitrot *)(db->ptr+offset);
+	offset+=de->d_reclen;
+	name=de->d_name;
+	if ((name[0]=='.') && (!name[1] || ((name[1]=='.') && !name[2]))) continue;
+	if (reserve_dents(db,count+1)) GOTOERROR;
+	entries=db->entries;
+	entries[count].name=name;
+	entries[count].ino=de->d_ino;
+	entries[count].type=de->d_type;
+	count+=1;
+}
+entries=db->entries;
+if (count>1) qsort(entries,count,sizeof(struct entry_dents),cmpino_dents);
+#else
+// readdir reuses its entry, so it's one at a time
+if (reserve_dents(db,1)) GOTOERROR;
+entries=db->entries;
+while (1) {
+	struct dirent *de;
+	char *name;
+	errno=0;
+	de=readdir(d->dir);
+	if (!de) {
+		if (errno) GOTOERROR;
+		break;
+	}
+	name=de->d_name;
+	if ((name[0]=='.') && (!name[1] || ((name[1]=='.') && !name[2]))) continue;
+	entries[0].name=name;
+	entries[0].ino=de->d_ino;
+	entries[0].type=de->d_type;
+	count=1;
+	break;
+}
+#endif
+*entries_out=entries;
+*count_out=count;
+return 0;
+error:
+	return -1;
+}
 
-(ignore)fwrite(line,n+1,1,stderr);
+static int statentry(struct bitrot *b, struct dir_bitrot *db, struct entry_dents *e, int dfd) {
+// metadata pass, sets e->isskip for entries that don't need the content pass
+FILE *msgout=b->options.msgout;
+int isverbose=b->options.isverbose;
+
+e->isskip=0;
+e->prefetched=0;
+e->file=NULL;
+if (e->type==DT_DIR) { // the subdirectory does its own xdev check on its fd
+	e->meta.mode=S_IFDIR;
+	return 0;
+}
+if ((e->type==DT_REG) && b->options.isnothingnew) { // skip before stat too
+	if (!(e->file=filename_find2_filebyname(db->files.topnode,e->name))) {
+		if (isverbose) {
+			if (printentry(b,"skipping new file: ",db,e->name)) GOTOERROR;
+		}
+		if (b->options.isprogress) {
+			(void)printprogress(b,0,e->name);
+		}
+		e->isskip=1;
+		return 0;
+	}
+}
+if ((e->type!=DT_REG) && (e->type!=DT_LNK) && (e->type!=DT_UNKNOWN) && !b->options.isonefilesystem) {
+	e->meta.mode=0; // special
+	return 0;
+}
+if (getmeta(&e->meta,dfd,e->name,b->options.isfollow)) GOTOERROR;
+if (b->options.isonefilesystem) { // skip dirs and files that are on other devices, possibly from symlinks
+	if (b->rootdir.xdev!=e->meta.dev) {
+		if (isverbose) {
+			(void)unprintprogress(b);
+			if (S_ISREG(e->meta.mode)) {
+				if (0>fputs("skipping xdev file: ",msgout)) GOTOERROR;
+			} else if (S_ISDIR(e->meta.mode)) {
+				if (0>fputs("skipping xdev dir: ",msgout)) GOTOERROR;
+			} else {
+				if (0>fputs("skipping xdev special: ",msgout)) GOTOERROR;
+			}
+			if (printpath(db,msgout)) GOTOERROR;
+			if (0>fputs(e->name,msgout)) GOTOERROR;
+			if (0>fputc('\n',msgout)) GOTOERROR;
+		}
+		e->isskip=1;
+		return 0;
+	}
+}
+if (S_ISREG(e->meta.mode)) {
+	if (e->meta.mtime>=b->options.ceiling_mtime) {
+		if (isverbose) {
+			if (printentry(b,"skipping recently changed: ",db,e->name)) GOTOERROR;
+		}
+		e->isskip=1; // ignore files that are too new
+		return 0;
+	}
+	if (!e->file) e->file=filename_find2_filebyname(db->files.topnode,e->name);
+	if (b->options.isnothingnew && !e->file) { // want to skip before md5
+		if (isverbose) {
+			if (printentry(b,"skipping new file: ",db,e->name)) GOTOERROR;
+		}
+		if (b->options.isprogress) {
+			(void)printprogress(b,0,e->name);
+		}
+		e->isskip=1;
+	}
+}
+return 0;
+error:
+	return -1;
 }
-static void printprogress(struct bitrot *b, int ismd5, char *name) {
-// scantar used to need x<=100 in strnlen(name,x)
-char *line;
-unsigned int n,m,columns;
-time_t t;
 
-t=time(NULL);
-if (b->progress.isprinted) {
-	if (t<b->progress.nextupdate) return;
-	(void)unprintprogress(b); // this could exceed columns if we had a resize but we have races there anyway
+static void prefetch_dents(struct prefetch_dents *pf, struct bitrot *b, struct entry_dents *entries, unsigned int count,
+		unsigned int cur, int dfd) {
+// starts reads for the next few files so the disk isn't idle while the current one is hashed
+#ifdef POSIX_FADV_WILLNEED
+if (entries[cur].prefetched) {
+	pf->pending-=1;
+	pf->bytes-=entries[cur].prefetched;
+}
+if (pf->next<=cur) pf->next=cur+1;
+while ((pf->pending<b->options.prefetchcount) && (pf->next<count) && (pf->bytes<PREFETCHBYTES_BITROT)) {
+	struct entry_dents *e=&entries[pf->next];
+	uint64_t len;
+	int fd;
+	pf->next+=1;
+	if (e->isskip || !S_ISREG(e->meta.mode) || !e->meta.size) continue;
+	if ((e->meta.nlink>1) && key_find2_bykey(b->hardlinks.inodes,e->meta.dev,e->meta.ino)) continue;
+	fd=openat(dfd,e->name,O_RDONLY);
+	if (fd<0) continue; // getmd5 will report it
+	len=_BADMIN(e->meta.size,PREFETCHBYTES_BITROT-pf->bytes);
+	(ignore)posix_fadvise(fd,0,len,POSIX_FADV_WILLNEED);
+	(ignore)close(fd);
+	e->prefetched=len;
+	pf->pending+=1;
+	pf->bytes+=len;
+}
+#endif
 }
-b->progress.isprinted=1;
-b->progress.nextupdate=t+1;
 
-line=b->progress.line;
+static int scandirB(struct bitrot *b, struct dir_bitrot *db, int parentfd, char *dirname);
+static int scanentry(struct bitrot *b, struct dir_bitrot *db, struct entry_dents *e, int dfd) {
+// content pass, hashes files and goes into directories
+int isverbose=b->options.isverbose;
+char *name=e->name;
 
-n=snprintf(line,MAX_LINE_PROGRESS_BITROT+1,"bitrot: %"PRIu64"MB %s",b->stats.bytesprocessed/(1024*1024),ismd5?"+ ":"- ");
-if (n>=MAX_LINE_PROGRESS_BITROT) return;
+if (S_ISREG(e->meta.mode)) {
+	struct file_bitrot *file=e->file;
+	unsigned char md5[LEN_MD5_BITROT];
+	{
+		int isnofile;
+		if (hashfile(&isnofile,b,md5,dfd,name,&e->meta)) GOTOERROR;
+		if (isnofile) {
+			if (isverbose) {
+				if (printentry(b,"Unable to read: ",db,name)) GOTOERROR;
+			}
+			return 0;
+		}
+	}
+	if (file) {
+		if (comparefile(b,db,file,name,md5,e->meta.mtime)) GOTOERROR;
+	} else {
+		if (!(file=ALLOC_blockmem(&b->blockmem,struct file_bitrot))) GOTOERROR;
+		clear_file_bitrot(file);
+		if (!(file->name=strdup_blockmem(&b->blockmem,name))) GOTOERROR;
+		file->flags=ISFOUND_FLAG_BITROT|ISCHANGED_FLAG_BITROT;
+		memcpy(file->md5,md5,LEN_MD5_BITROT);
+		(void)addnode2_filebyname(&db->files.topnode,file);
+		b->stats.changecount+=1;
+		if (isverbose) {
+			if (printentry(b,"new file: ",db,name)) GOTOERROR;
+		}
+	}
+// if S_ISREG
+} else if (S_ISDIR(e->meta.mode)) {
+	struct dir_bitrot *ndb;
+	if (b->options.isnothingnew) {
+		ndb=filename_find2_dirbyname(db->children.topnode,name);
+		if (ndb) {
+			ndb->flags|=ISFOUND_FLAG_BITROT;
+			if (scandirB(b,ndb,dfd,name)) GOTOERROR;
+		} else {
+			if (isverbose) {
+				if (printentry(b,"skipping new directory: ",db,name)) GOTOERROR;
+			}
+		}
+	} else {
+		if (findoradd_dir(&ndb,&b->blockmem,db,name,ISFOUND_FLAG_BITROT)) GOTOERROR;
+		if (scandirB(b,ndb,dfd,name)) GOTOERROR;
+	}
+// if S_ISDIR
+} else { // special file
+	if (isverbose) {
+		if (printentry(b,"ignoring special: ",db,name)) GOTOERROR;
+	}
+	if (b->options.isprogress) {
+		(void)printprogress(b,0,name);
+	}
+}
+return 0;
+error:
+	return -1;
+}
+
+static int scandirB(struct bitrot *b, struct dir_bitrot *db, int parentfd, char *dirname) {
+// parentfd<0 for the top directory
+struct dents_bitrot dents;
+struct stat statbuf;
+int fd;
+
+#if 0
+fprintf(stderr,"Entering directory %s\n",dirname);
+#endif
+
+dents.fd=-1;
+
+if (parentfd<0) { // topdir
+	fd=open(dirname,O_RDONLY|O_DIRECTORY);
+	if (fd<0) GOTOERROR;
+	if (fstat(fd,&statbuf)) {
+		(ignore)close(fd);
+		GOTOERROR;
+	}
+	if (b->options.isonefilesystem) {
+		b->rootdir.xdev=statbuf.st_dev;
+		if (b->rootdir.xdev==INVALID_DEVT_BITROT) {
+			(ignore)close(fd);
+			fprintf(stderr,"%s:%d Top directory has unexpected dev_t value that conflicts with --one-file-system\n",__FILE__,__LINE__);
+			GOTOERROR;
+		}
+	}
+} else { // all other cases
+	fd=openat(parentfd,dirname,O_RDONLY|O_DIRECTORY);
+	if (fd<0) GOTOERROR;
+	if (fstat(fd,&statbuf)) {
+		(ignore)close(fd);
+		GOTOERROR;
+	}
+	if (b->options.isonefilesystem) {
+		if (b->rootdir.xdev!=statbuf.st_dev) { // maybe a --bind mount
+			(ignore)close(fd);
+			if (b->options.isverbose) {
+				if (printentry(b,"skipping xdev dir: ",db->parent,dirname)) GOTOERROR;
+			}
+			return 0;
+		}
+	}
+	if (key_find2_bykey(b->visited.dirs,statbuf.st_dev,statbuf.st_ino)) { // a symlink loop or a second bind mount
+		(ignore)close(fd);
+		if (b->options.isverbose) {
+			if (printentry(b,"skipping repeated directory: ",db->parent,dirname)) GOTOERROR;
+		}
+		return 0;
+	}
+}
+if (setkey(&b->visited.dirs,&b->blockmem,statbuf.st_dev,statbuf.st_ino,NULL)) {
+	(ignore)close(fd);
+	GOTOERROR;
+}
+if (init_dents(&dents,b,fd)) GOTOERROR;
+
+while (1) {
+	struct entry_dents *entries;
+	struct prefetch_dents prefetch;
+	unsigned int i,count;
+	if (fill_dents(&entries,&count,&dents,b)) GOTOERROR;
+	if (!count) break;
+	for (i=0;i<count;i++) { // inode order, then the same order for opens
+		if (statentry(b,db,&entries[i],dents.fd)) GOTOERROR;
+	}
+	memset(&prefetch,0,sizeof(prefetch));
+	for (i=0;i<count;i++) {
+		if (entries[i].isskip) continue;
+		if (b->options.prefetchcount && !b->options.readusleep) (void)prefetch_dents(&prefetch,b,entries,count,i,dents.fd);
+		if (scanentry(b,db,&entries[i],dents.fd)) GOTOERROR;
+	}
+}
+
+(void)deinit_dents(&dents,b);
+return 0;
+error:
+	(void)deinit_dents(&dents,b);
+	return -1;
+}
+
+int scandir_bitrot(struct bitrot *b, char *dirname) {
+struct dir_bitrot *db;
+char *subtree,*fullpath=NULL;
+
+subtree=b->options.subtree;
+if (!subtree) {
+	if (scandirB(b,&b->topdir,-1,dirname)) GOTOERROR;
+	return 0;
+}
+
+// the subtree hangs from its parents, so printed and saved paths are still relative to dirname
+db=&b->topdir;
+while (1) {
+	char *slash;
+	int r;
+	slash=strchr(subtree,'/');
+	if (slash) *slash='\0';
+	r=findoradd_dir(&db,&b->blockmem,db,subtree,ISFOUND_FLAG_BITROT);
+	if (slash) *slash='/';
+	if (r) GOTOERROR;
+	if (!slash) break;
+	subtree=slash+1;
+}
+if (!(fullpath=malloc(strlen(dirname)+1+strlen(b->options.subtree)+1))) GOTOERROR;
+sprintf(fullpath,"%s/%s",dirname,b->options.subtree);
+if (access(fullpath,F_OK)) {
+	fprintf(stderr,"%s:%d error opening subtree %s (%s)\n",__FILE__,__LINE__,fullpath,strerror(errno));
+	GOTOERROR;
+}
+if (scandirB(b,db,-1,fullpath)) GOTOERROR;
+free(fullpath);
+return 0;
+error:
+	iffree(fullpath);
+	return -1;
+}
+
+struct hashfile_verify {
+	struct file_bitrot *file;
+	uint64_t size,mtime;
+	unsigned char md5[LEN_MD5_BITROT];
+	int isnofile;
+};
+
+struct verify_bitrot {
+	struct bitrot *b;
+	int dfd; // the directory of the current batch
+	int fstatatflags;
+	struct hashfile_verify *list;
+	unsigned int count,max;
+	pthread_mutex_t mutex;
+	unsigned char **buffers; // unused iobuffers, one per thread that's had a file
+	unsigned int nbuffers;
+	unsigned int threads;
+};
+
+static int addbuffers_verify(struct verify_bitrot *v) {
+// runjobs starts at most count threads, so a small directory doesn't need every buffer
+unsigned int want;
+want=v->threads;
+if (want>v->count) want=v->count;
+while (v->nbuffers<want) { // between batches, every buffer is back in the list
+	if (!(v->buffers[v->nbuffers]=malloc(v->b->iobuffer.ptrmax))) GOTOERROR;
+	v->nbuffers+=1;
+}
+return 0;
+error:
+	return -1;
+}
+
+static int hashfile_verify(void *arg, unsigned int i) {
+struct verify_bitrot *v=arg;
+struct hashfile_verify *hf=&v->list[i];
+unsigned char *buffer;
+int r;
+
+(ignore)pthread_mutex_lock(&v->mutex);
+v->nbuffers-=1;
+buffer=v->buffers[v->nbuffers];
+(ignore)pthread_mutex_unlock(&v->mutex);
+
+r=getmd5B(&hf->isnofile,buffer,v->b->iobuffer.ptrmax,v->b->options.readusleep,v->b->options.smallfilemax,
+		hf->md5,v->dfd,hf->file->name,hf->size);
+
+(ignore)pthread_mutex_lock(&v->mutex);
+v->buffers[v->nbuffers]=buffer;
+v->nbuffers+=1;
+(ignore)pthread_mutex_unlock(&v->mutex);
+return r;
+}
+
+static int addfiles_verify(struct verify_bitrot *v, struct dir_bitrot *db, struct file_bitrot *file) {
+// stats the cataloged files, in order, and queues the ones to hash
+struct bitrot *b=v->b;
+struct stat statbuf;
+uint64_t mtime;
+
+if (file->treevars.left) {
+	if (addfiles_verify(v,db,file->treevars.left)) GOTOERROR;
+}
+
+if (fstatat(v->dfd,file->name,&statbuf,v->fstatatflags)) {
+	if ((errno!=ENOENT) && (errno!=ENOTDIR)) {
+		fprintf(stderr,"%s:%d error getting stat for %s (%s)\n",__FILE__,__LINE__,file->name,strerror(errno));
+		GOTOERROR;
+	}
+	if (printentry(b,"missing file: ",db,file->name)) GOTOERROR;
+	goto next;
+}
+if (b->options.isonefilesystem && (b->rootdir.xdev!=statbuf.st_dev)) {
+	if (b->options.isverbose) {
+		if (printentry(b,"skipping xdev file: ",db,file->name)) GOTOERROR;
+	}
+	goto next;
+}
+if (!S_ISREG(statbuf.st_mode)) {
+	if (b->options.isverbose) {
+		if (printentry(b,"ignoring special: ",db,file->name)) GOTOERROR;
+	}
+	goto next;
+}
+#ifdef LINUX
+mtime=statbuf.st_mtim.tv_sec;
+#elif OSX
+mtime=statbuf.st_mtimespec.tv_sec;
+#endif
+if (mtime>=b->options.ceiling_mtime) {
+	if (b->options.isverbose) {
+		if (printentry(b,"skipping recently changed: ",db,file->name)) GOTOERROR;
+	}
+	goto next;
+}
+if (v->count==v->max) {
+	struct hashfile_verify *temp;
+	unsigned int newmax;
+	newmax=v->max*2+64;
+	if (!(temp=realloc(v->list,newmax*sizeof(struct hashfile_verify)))) GOTOERROR;
+	v->list=temp;
+	v->max=newmax;
+}
+v->list[v->count].file=file;
+v->list[v->count].size=statbuf.st_size;
+v->list[v->count].mtime=mtime;
+v->count+=1;
+
+next:
+if (file->treevars.right) {
+	if (addfiles_verify(v,db,file->treevars.right)) GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
+
+static int verifydirs(struct verify_bitrot *v, struct dir_bitrot *dir, int parentfd);
+static int verifydirB(struct verify_bitrot *v, struct dir_bitrot *db, int dfd) {
+// hashes db's files as one batch, then goes into its subdirectories
+struct bitrot *b=v->b;
+unsigned int i;
+
+if (db->files.topnode) {
+	v->dfd=dfd;
+	v->count=0;
+	if (addfiles_verify(v,db,db->files.topnode)) GOTOERROR;
+	if (addbuffers_verify(v)) GOTOERROR;
+	if (runjobs(b->options.threads,v->count,hashfile_verify,v)) GOTOERROR;
+	for (i=0;i<v->count;i++) { // in order, so messages don't depend on the threads
+		struct hashfile_verify *hf=&v->list[i];
+		if (b->options.isprogress) {
+			(void)printprogress(b,1,hf->file->name);
+		}
+		b->stats.bytesprocessed+=hf->size;
+		if (hf->isnofile) {
+			if (b->options.isverbose) {
+				if (printentry(b,"Unable to read: ",db,hf->file->name)) GOTOERROR;
+			}
+			continue;
+		}
+		if (comparefile(b,db,hf->file,hf->file->name,hf->md5,hf->mtime)) GOTOERROR;
+	}
+}
+if (db->children.topnode) {
+	if (verifydirs(v,db->children.topnode,dfd)) GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
+
+static int verifydirs(struct verify_bitrot *v, struct dir_bitrot *dir, int parentfd) {
+// dir and its siblings
+struct bitrot *b=v->b;
+int fd=-1;
+
+if (dir->treevars.left) {
+	if (verifydirs(v,dir->treevars.left,parentfd)) GOTOERROR;
+}
+
+fd=openat(parentfd,dir->name,O_RDONLY|O_DIRECTORY|(b->options.isfollow?0:O_NOFOLLOW));
+if (fd<0) {
+	if ((errno!=ENOENT) && (errno!=ENOTDIR) && (errno!=ELOOP)) {
+		fprintf(stderr,"%s:%d error opening directory %s (%s)\n",__FILE__,__LINE__,dir->name,strerror(errno));
+		GOTOERROR;
+	}
+	if (printentry(b,"missing directory: ",dir->parent,dir->name)) GOTOERROR;
+} else {
+	int isxdev=0;
+	if (b->options.isonefilesystem) {
+		struct stat statbuf;
+		if (fstat(fd,&statbuf)) GOTOERROR;
+		if (b->rootdir.xdev!=statbuf.st_dev) {
+			isxdev=1;
+			if (b->options.isverbose) {
+				if (printentry(b,"skipping xdev dir: ",dir->parent,dir->name)) GOTOERROR;
+			}
+		}
+	}
+	if (!isxdev) {
+		dir->flags|=ISFOUND_FLAG_BITROT;
+		if (verifydirB(v,dir,fd)) GOTOERROR;
+	}
+	(ignore)close(fd);
+	fd=-1;
+}
+
+if (dir->treevars.right) {
+	if (verifydirs(v,dir->treevars.right,parentfd)) GOTOERROR;
+}
+return 0;
+error:
+	ifclose(fd);
+	return -1;
+}
 
-#if 0
-unsigned int space;
-m=strnlen(name,100); // need 100 limit for tar
-space=MAX_LINE_PROGRESS_BITROT-n;
-if (m>space) m=space;
-#endif
-m=strnlen(name,MAX_LINE_PROGRESS_BITROT-n); // no limit needed now
+int verify_bitrot(struct bitrot *b, char *dirname) {
+// --catalog-only, walks the loaded tree instead of listing directories
+struct verify_bitrot v;
+unsigned int i;
+int fd=-1;
+int ismutex=0;
 
-memcpy(line+n,name,m);
-n+=m;
+memset(&v,0,sizeof(v));
+v.b=b;
+if (b->options.isfollow) {
+	v.fstatatflags=0;
+} else {
+	v.fstatatflags=AT_SYMLINK_NOFOLLOW;
+}
+v.threads=b->options.threads;
+if (!(v.buffers=malloc(v.threads*sizeof(unsigned char *)))) GOTOERROR;
+v.buffers[0]=b->iobuffer.ptr;
+v.nbuffers=1;
+if (pthread_mutex_init(&v.mutex,NULL)) GOTOERROR;
+ismutex=1;
 
-{
-	struct winsize ws;
-	if (!ioctl(STDERR_FILENO,TIOCGWINSZ,&ws)) {
-		columns=ws.ws_col;
-		if (columns>2) columns-=2;
-	} else {
-		columns=78;
+fd=open(dirname,O_RDONLY|O_DIRECTORY);
+if (fd<0) {
+	fprintf(stderr,"%s:%d error opening %s (%s)\n",__FILE__,__LINE__,dirname,strerror(errno));
+	GOTOERROR;
+}
+if (b->options.isonefilesystem) {
+	struct stat statbuf;
+	if (fstat(fd,&statbuf)) GOTOERROR;
+	b->rootdir.xdev=statbuf.st_dev;
+	if (b->rootdir.xdev==INVALID_DEVT_BITROT) {
+		fprintf(stderr,"%s:%d Top directory has unexpected dev_t value that conflicts with --one-file-system\n",__FILE__,__LINE__);
+		GOTOERROR;
 	}
 }
+if (verifydirB(&v,&b->topdir,fd)) GOTOERROR;
 
-n=_BADMIN(n,columns);
-b->progress.linelength=n;
-line[n]='\r'; // we have +1 allocated
-
-(ignore)fwrite(line,n+1,1,stderr);
+(ignore)close(fd);
+(ignore)pthread_mutex_destroy(&v.mutex);
+for (i=0;i<v.nbuffers;i++) {
+	if (v.buffers[i]!=b->iobuffer.ptr) free(v.buffers[i]);
 }
-void unprintprogress_bitrot(struct bitrot *b) {
-unprintprogress(b);
+free(v.buffers);
+iffree(v.list);
+return 0;
+error:
+	ifclose(fd);
+	if (ismutex) (ignore)pthread_mutex_destroy(&v.mutex);
+	if (v.buffers) {
+		for (i=0;i<v.nbuffers;i++) {
+			if (v.buffers[i]!=b->iobuffer.ptr) free(v.buffers[i]);
+		}
+		free(v.buffers);
+	}
+	iffree(v.list);
+	return -1;
 }
 
-#ifdef USEMMAP
-#ifdef OPENSSL
-static int getmd5_mmap(int *isnommap_out, MD5_CTX *ctx, int fd, uint64_t st_size, unsigned int readusleep) {
-#else
-static void getmd5_mmap(int *isnommap_out, MD5_CTX *ctx, int fd, uint64_t st_size, unsigned int readusleep) {
-#endif
-unsigned char *ptr;
-struct mmapwrapper mw;
-uint64_t left;
+struct entry_stream {
+	char *name;
+	struct meta_bitrot meta;
+};
 
-clear_mmapwrapper(&mw);
+struct stream_bitrot {
+	FILE *ff;
+	char *sumfile;
+	char *line,*prevline;
+	char *path,*prevpath; // current and previous catalog entries, path is NULL at the end
+	unsigned char md5[LEN_MD5_BITROT];
+	struct writer_bitrot writer; // writer.path is the current directory
+};
 
-#if UINTPTR_MAX == 0xffffffff
-#warning compiling for 32bit pointers
-if (st_size>0xff000000) { // on 32bit machines, we fall back on read() for files that don't fit
-// TODO manage 32bit allocations of mmap
-	*isnommap_out=1;
-#ifdef OPENSSL
-	return 0;
-#else
-	return;
-#endif
+static int cmppath_stream(char *a, char *b) {
+// the order of writedir_writer: in each directory, subdirectories then files, both by strcmp
+while (1) {
+	char *sa,*sb;
+	sa=strchr(a,'/');
+	sb=strchr(b,'/');
+	if (sa && sb) {
+		unsigned int la,lb;
+		int c;
+		la=sa-a;
+		lb=sb-b;
+		c=memcmp(a,b,_BADMIN(la,lb));
+		if (c) return c;
+		if (la!=lb) return (la<lb)?-1:1;
+		a=sa+1;
+		b=sb+1;
+		continue;
+	}
+	if (sa) return -1;
+	if (sb) return 1;
+	return strcmp(a,b);
+}
 }
-#endif
 
-if (initreadfd2_mmapwrapper(&mw,fd,st_size)) { // can only fail by mmap
-	*isnommap_out=1;
-#ifdef OPENSSL
-	return 0;
-#else
-	return;
-#endif
+static int next_stream(struct stream_bitrot *s) {
+// advances to the next catalog entry
+char *temp;
+temp=s->prevline;
+s->prevline=s->line;
+s->line=temp;
+s->prevpath=s->path;
+s->path=NULL;
+if (!s->ff) return 0;
+while (1) {
+	char *path;
+	if (!fgets(s->line,MAXLINELEN,s->ff)) {
+		if (ferror(s->ff)) GOTOERROR;
+		return 0;
+	}
+	if (parsesumline(&path,s->md5,s->line,s->sumfile)) GOTOERROR;
+	if (!path) continue;
+	while (!strncmp(path,"./",2)) path+=2;
+	s->path=path;
+	break;
+}
+if (s->prevpath && (0<=cmppath_stream(s->prevpath,s->path))) {
+	fprintf(stderr,"%s:%d %s is not in sorted order at \"%s\", run once without --stream to sort it\n",
+			__FILE__,__LINE__,s->sumfile,s->path);
+	GOTOERROR;
+}
+return 0;
+error:
+	return -1;
 }
 
-{
-	ptr=mw.addr;
-	left=mw.filesize;
+static inline char *under_stream(struct stream_bitrot *s) {
+// the rest of the current entry, if it's in the current directory or below
+struct writer_bitrot *w=&s->writer;
+if (!s->path) return NULL;
+if (strncmp(s->path,w->path,w->pathlen)) return NULL;
+return s->path+w->pathlen;
+}
 
-	while (1) {
-		if (!left) break;
-		if (left>READCHUNK_BITROT) {
-#ifdef OPENSSL
-			if (1!=MD5_Update(ctx,ptr,READCHUNK_BITROT)) GOTOERROR;
-#elif GNUTLS
-			(void)MD5_Update(ctx,ptr,READCHUNK_BITROT);
-#else
-			(void)addbytes_context_md5(ctx,ptr,READCHUNK_BITROT);
-#endif
-			ptr+=READCHUNK_BITROT;
-			left-=READCHUNK_BITROT;
-		} else {
-			int k;
-			k=left;
-#ifdef OPENSSL
-			if (1!=MD5_Update(ctx,ptr,k)) GOTOERROR;
-#elif GNUTLS
-			(void)MD5_Update(ctx,ptr,k);
-#else
-			(void)addbytes_context_md5(ctx,ptr,k);
-#endif
-			break;
-		}
-		if (readusleep) usleep(readusleep);
-	}
+static inline int cmpcomponent(char *rest, unsigned int len, char *name) {
+int c;
+c=strncmp(rest,name,len);
+if (c) return c;
+if (name[len]) return -1;
+return 0;
 }
 
-*isnommap_out=0;
-deinit_mmapwrapper(&mw);
-#ifdef OPENSSL
+static int skipdirs_stream(struct stream_bitrot *s, char *name) {
+// drops entries in subdirectories that sort before name, or all subdirectories if name is NULL
+while (1) {
+	char *rest,*slash;
+	rest=under_stream(s);
+	if (!rest) break;
+	slash=strchr(rest,'/');
+	if (!slash) break;
+	if (name && (0<=cmpcomponent(rest,slash-rest,name))) break;
+	if (next_stream(s)) GOTOERROR;
+}
 return 0;
 error:
-	deinit_mmapwrapper(&mw);
 	return -1;
-#endif
 }
-// end USEMMAP
-#endif
-
-static int getmd5(int *isnofile_out, struct bitrot *b, unsigned char *dest, int dfd, char *name, struct stat *statbuf) {
-MD5_CTX ctx;
-unsigned char *ptr;
-unsigned int ptrmax;
-unsigned int readusleep;
-uint64_t st_size;
-int fd=-1;
 
+static int skipfiles_stream(struct stream_bitrot *s, char *name) {
+// drops file entries in this directory that sort before name, or all of them if name is NULL
+while (1) {
+	char *rest;
+	rest=under_stream(s);
+	if (!rest) break;
+	if (strchr(rest,'/')) GOTOERROR; // can't happen after skipdirs_stream
+	if (name && (0<=strcmp(rest,name))) break;
+	if (next_stream(s)) GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
 
-st_size=statbuf->st_size;
-if (!st_size) {
-	memcpy(dest,zeromd5,16);
-} else {
-	int isnommap;
-#ifdef OPENSSL
-	if (1!=MD5_Init(&ctx)) GOTOERROR; // probably can't happen
-#elif GNUTLS
-	(void)MD5_Init(&ctx);
-#else
-	(void)clear_context_md5(&ctx);
-#endif
-	readusleep=b->options.readusleep;
+static int cmpdirs_stream(const void *a, const void *b) {
+return strcmp(*(char **)a,*(char **)b);
+}
+static int cmpfiles_stream(const void *a, const void *b) {
+return strcmp(((struct entry_stream *)a)->name,((struct entry_stream *)b)->name);
+}
 
-	fd=openat(dfd,name,O_RDONLY);
-	if (0>fd) {
-		if ((errno==EACCES) || (errno==EPERM)) {
-			*isnofile_out=1;
-			return 0;
-		}
-		fprintf(stderr,"%s:%d error opening %s, (%s)\n",__FILE__,__LINE__,name,strerror(errno));
-		GOTOERROR;
-	}
+static int streamfile(struct bitrot *b, struct stream_bitrot *s, struct dir_bitrot *db, int dfd,
+		struct entry_stream *entry) {
+struct writer_bitrot *w=&s->writer;
+unsigned char md5[LEN_MD5_BITROT];
+struct file_bitrot file;
+int isknown=0;
+int isnofile;
+char *rest;
 
-#ifdef USEMMAP
-#ifdef OPENSSL
-	if (getmd5_mmap(&isnommap,&ctx,fd,st_size,readusleep)) GOTOERROR;
-#else
-	(void)getmd5_mmap(&isnommap,&ctx,fd,st_size,readusleep);
-#endif
-#else
-	isnommap=1;
-#endif
-	if (isnommap) {
-		ptr=b->iobuffer.ptr;
-		ptrmax=b->iobuffer.ptrmax;
+if (skipfiles_stream(s,entry->name)) GOTOERROR;
+rest=under_stream(s);
+if (rest && !strcmp(rest,entry->name)) isknown=1;
 
-		while (1) {
-			int k;
-			k=read(fd,ptr,ptrmax);
-			if (k<=0) {
-				if (!k) break;
-				GOTOERROR;
-			}
-#ifdef OPENSSL
-			if (1!=MD5_Update(&ctx,ptr,k)) GOTOERROR;
-#elif GNUTLS
-			(void)MD5_Update(&ctx,ptr,k);
-#else
-			(void)addbytes_context_md5(&ctx,ptr,k);
-#endif
-			if (readusleep) usleep(readusleep);
-		}
+if (!isknown && b->options.isnothingnew) {
+	if (b->options.isverbose) {
+		if (printentry(b,"skipping new file: ",db,entry->name)) GOTOERROR;
 	}
+	if (b->options.isprogress) {
+		(void)printprogress(b,0,entry->name);
+	}
+	return 0;
+}
 
-#ifdef OPENSSL
-	if (1!=MD5_Final(dest,&ctx)) GOTOERROR;
-#elif GNUTLS
-	(void)MD5_Final(dest,&ctx);
-#else
-	(void)finish_context_md5(dest,&ctx);
-#endif
-	(ignore)close(fd);
+if (hashfile(&isnofile,b,md5,dfd,entry->name,&entry->meta)) GOTOERROR;
+if (isnofile) {
+	if (b->options.isverbose) {
+		if (printentry(b,"Unable to read: ",db,entry->name)) GOTOERROR;
+	}
+	if (isknown) {
+		if (next_stream(s)) GOTOERROR;
+	}
+	return 0;
 }
 
-*isnofile_out=0;
+if (isknown) {
+	clear_file_bitrot(&file);
+	file.name=entry->name;
+	file.flags=ISINFILE_FLAG_BITROT;
+	memcpy(file.md5,s->md5,LEN_MD5_BITROT);
+	if (comparefile(b,db,&file,entry->name,md5,entry->meta.mtime)) GOTOERROR;
+	if (addline_writer(w,file.md5,entry->name)) GOTOERROR;
+	if (next_stream(s)) GOTOERROR;
+} else {
+	b->stats.changecount+=1;
+	if (b->options.isverbose) {
+		if (printentry(b,"new file: ",db,entry->name)) GOTOERROR;
+	}
+	if (addline_writer(w,md5,entry->name)) GOTOERROR;
+}
 return 0;
 error:
-	ifclose(fd);
 	return -1;
 }
 
-static int scandirB(struct bitrot *b, struct dir_bitrot *db, DIR *parentdir, char *dirname) {
-DIR *dir=NULL;
+static int streamdirB(struct bitrot *b, struct stream_bitrot *s, struct dir_bitrot *db, int parentfd, char *dirname) {
+// like scandirB, but merges with the sorted catalog instead of a loaded tree
+struct writer_bitrot *w=&s->writer;
+struct blockmem names;
+char **dirs=NULL;
+unsigned int dircount=0,dirmax=0;
+struct entry_stream *files=NULL;
+unsigned int filecount=0,filemax=0;
 struct stat statbuf;
+DIR *dir=NULL;
 int isverbose;
-int isnothingnew;
 int fstatatflags;
-FILE *msgout=b->options.msgout;
-
-#if 0
-fprintf(stderr,"Entering directory %s\n",dirname);
-#endif
+unsigned int i;
 
 isverbose=b->options.isverbose;
-isnothingnew=b->options.isnothingnew;
+clear_blockmem(&names);
 
-if (!parentdir) { // topdir
+if (parentfd<0) { // topdir
 	if (!(dir=opendir(dirname))) GOTOERROR;
+	if (fstat(dirfd(dir),&statbuf)) GOTOERROR;
 	if (b->options.isonefilesystem) {
-		if (fstat(dirfd(dir),&statbuf)) GOTOERROR;
 		b->rootdir.xdev=statbuf.st_dev;
 		if (b->rootdir.xdev==INVALID_DEVT_BITROT) {
 			fprintf(stderr,"%s:%d Top directory has unexpected dev_t value that conflicts with --one-file-system\n",__FILE__,__LINE__);
 			GOTOERROR;
 		}
 	}
-} else { // all other cases
+} else {
 	int fd;
-	fd=openat(dirfd(parentdir),dirname,O_RDONLY);
+	fd=openat(parentfd,dirname,O_RDONLY);
 	if (fd<0) GOTOERROR;
+	if (fstat(fd,&statbuf)) {
+		(ignore)close(fd);
+		GOTOERROR;
+	}
 	if (b->options.isonefilesystem) {
-		if (fstat(fd,&statbuf)) GOTOERROR;
 		if (b->rootdir.xdev!=statbuf.st_dev) { // maybe a --bind mount
 			(ignore)close(fd);
 			if (isverbose) {
-				(void)unprintprogress(b);
-				if (0>fputs("skipping xdev dir: ",msgout)) GOTOERROR;
-				if (printpath(db,msgout)) GOTOERROR;
-				if (0>fputs(dirname,msgout)) GOTOERROR;
-				if (0>fputc('\n',msgout)) GOTOERROR;
+				if (printentry(b,"skipping xdev dir: ",db->parent,dirname)) GOTOERROR;
 			}
 			return 0;
 		}
 	}
+	if (key_find2_bykey(b->visited.dirs,statbuf.st_dev,statbuf.st_ino)) {
+		(ignore)close(fd);
+		if (isverbose) {
+			if (printentry(b,"skipping repeated directory: ",db->parent,dirname)) GOTOERROR;
+		}
+		return 0;
+	}
 	if (!(dir=fdopendir(fd))) {
 		(ignore)close(fd);
 		GOTOERROR;
 	}
-	fd=-1;
 }
 
+if (setkey(&b->visited.dirs,&b->blockmem,statbuf.st_dev,statbuf.st_ino,NULL)) GOTOERROR;
+
 if (b->options.isfollow) {
 	fstatatflags=0;
 } else {
 	fstatatflags=AT_SYMLINK_NOFOLLOW;
 }
 
+if (init_blockmem(&names,0)) GOTOERROR;
 while (1) {
 	struct dirent *de;
-	struct file_bitrot *file;
-	unsigned char md5[LEN_MD5_BITROT];
 	errno=0;
 	de=readdir(dir);
 	if (!de) {
@@ -649,164 +3425,59 @@ while (1) {
 	if (!strcmp(de->d_name,".")) continue;
 	if (!strcmp(de->d_name,"..")) continue;
 	if (fstatat(dirfd(dir),de->d_name,&statbuf,fstatatflags)) GOTOERROR;
-	if (b->options.isonefilesystem) { // skip dirs and files that are on other devices, possibly from symlinks
+	if (b->options.isonefilesystem) {
 		if (b->rootdir.xdev!=statbuf.st_dev) {
 			if (isverbose) {
-				(void)unprintprogress(b);
-				if (S_ISREG(statbuf.st_mode)) {
-					if (0>fputs("skipping xdev file: ",msgout)) GOTOERROR;
-				} else if (S_ISDIR(statbuf.st_mode)) {
-					if (0>fputs("skipping xdev dir: ",msgout)) GOTOERROR;
-				} else {
-					if (0>fputs("skipping xdev special: ",msgout)) GOTOERROR;
-				}
-				if (printpath(db,msgout)) GOTOERROR;
-				if (0>fputs(de->d_name,msgout)) GOTOERROR;
-				if (0>fputc('\n',msgout)) GOTOERROR;
+				char *msg;
+				if (S_ISREG(statbuf.st_mode)) msg="skipping xdev file: ";
+				else if (S_ISDIR(statbuf.st_mode)) msg="skipping xdev dir: ";
+				else msg="skipping xdev special: ";
+				if (printentry(b,msg,db,de->d_name)) GOTOERROR;
 			}
 			continue;
 		}
 	}
 	if (S_ISREG(statbuf.st_mode)) {
+		struct entry_stream *entry;
+		uint64_t mtime;
 #ifdef LINUX
-		if (statbuf.st_mtim.tv_sec>=b->options.ceiling_mtime) {
+		mtime=statbuf.st_mtim.tv_sec;
 #elif OSX
-		if (statbuf.st_mtimespec.tv_sec>=b->options.ceiling_mtime) {
+		mtime=statbuf.st_mtimespec.tv_sec;
 #endif
+		if (mtime>=b->options.ceiling_mtime) {
 			if (isverbose) {
-				(void)unprintprogress(b);
-				if (0>fputs("skipping recently changed: ",msgout)) GOTOERROR;
-				if (printpath(db,msgout)) GOTOERROR;
-				if (0>fputs(de->d_name,msgout)) GOTOERROR;
-				if (0>fputc('\n',msgout)) GOTOERROR;
-			}
-			continue; // ignore files that are too new
-		}
-		file=filename_find2_filebyname(db->files.topnode,de->d_name);
-		if (isnothingnew && !file) { // want to skip before md5
-			if (isverbose) {
-				(void)unprintprogress(b);
-				if (0>fputs("skipping new file: ",msgout)) GOTOERROR;
-				if (printpath(db,msgout)) GOTOERROR;
-				if (0>fputs(de->d_name,msgout)) GOTOERROR;
-				if (0>fputc('\n',msgout)) GOTOERROR;
-			}
-			if (b->options.isprogress) {
-				(void)printprogress(b,0,de->d_name);
-			}
-			continue;
-		}
-		{
-			int isnofile;
-			if (b->options.isprogress) {
-				(void)printprogress(b,1,de->d_name);
-				if (getmd5(&isnofile,b,md5,dirfd(dir),de->d_name,&statbuf)) GOTOERROR;
-			} else {
-				if (getmd5(&isnofile,b,md5,dirfd(dir),de->d_name,&statbuf)) GOTOERROR;
-			}
-			b->stats.bytesprocessed+=statbuf.st_size;
-			if (isnofile) {
-				if (isverbose) {
-					(void)unprintprogress(b);
-					if (0>fputs("Unable to read: ",msgout)) GOTOERROR;
-					if (printpath(db,msgout)) GOTOERROR;
-					if (0>fputs(de->d_name,msgout)) GOTOERROR;
-					if (0>fputc('\n',msgout)) GOTOERROR;
-				}
-				continue;
-			}
-		}
-		if (file) {
-			file->flags|=ISFOUND_FLAG_BITROT;
-			if (memcmp(md5,file->md5,LEN_MD5_BITROT)) {
-				int issave=0;
-				file->flags|=ISMISMATCH_FLAG_BITROT;
-#ifdef LINUX
-				if (statbuf.st_mtim.tv_sec>=b->sumfile.mtime) { // if the mtime is updated, the file changing is not odd
-#elif OSX
-				if (statbuf.st_mtimespec.tv_sec>=b->sumfile.mtime) { // if the mtime is updated, the file changing is not odd
-#endif
-					issave=1;
-					if (isverbose) {
-						(void)unprintprogress(b);
-						if (0>fputs("file changed: ",msgout)) GOTOERROR;
-						if (printpath(db,msgout)) GOTOERROR;
-						if (0>fputs(de->d_name,msgout)) GOTOERROR;
-						if (0>fputc('\n',msgout)) GOTOERROR;
-					}
-				} else { // don't want to auto-update the md5 in case there was corruption
-					(void)unprintprogress(b);
-					if (b->options.issavechanges) {
-						issave=1; 
-						if (0>fputs("Updating new MD5: ",msgout)) GOTOERROR;
-					} else {
-						if (0>fputs("MD5 has changed: ",msgout)) GOTOERROR;
-					}
-					{
-						if (printpath(db,msgout)) GOTOERROR;
-						if (0>fputs(de->d_name,msgout)) GOTOERROR;
-						if (0>fputc('\n',msgout)) GOTOERROR;
-					}
-				}
-				if (issave) {
-					memcpy(file->md5,md5,LEN_MD5_BITROT);
-					b->stats.changecount+=1;
-				}
-			} else {
-				file->flags|=ISMATCHED_FLAG_BITROT;
-				if (isverbose) {
-					(void)unprintprogress(b);
-					if (0>fputs("matched: ",msgout)) GOTOERROR;
-					if (printpath(db,msgout)) GOTOERROR;
-					if (0>fputs(de->d_name,msgout)) GOTOERROR;
-					if (0>fputc('\n',msgout)) GOTOERROR;
-				}
-			}
-		} else {
-			if (!(file=ALLOC_blockmem(&b->blockmem,struct file_bitrot))) GOTOERROR;
-			clear_file_bitrot(file);
-			if (!(file->name=strdup_blockmem(&b->blockmem,de->d_name))) GOTOERROR;
-			file->flags=ISFOUND_FLAG_BITROT;
-			memcpy(file->md5,md5,LEN_MD5_BITROT);
-			(void)addnode2_filebyname(&db->files.topnode,file);
-			b->stats.changecount+=1;
-			if (isverbose) {
-				(void)unprintprogress(b);
-				if (0>fputs("new file: ",msgout)) GOTOERROR;
-				if (printpath(db,msgout)) GOTOERROR;
-				if (0>fputs(de->d_name,msgout)) GOTOERROR;
-				if (0>fputc('\n',msgout)) GOTOERROR;
+				if (printentry(b,"skipping recently changed: ",db,de->d_name)) GOTOERROR;
 			}
+			continue;
+		}
+		if (filecount==filemax) {
+			struct entry_stream *temp;
+			filemax=filemax*2+64;
+			if (!(temp=realloc(files,filemax*sizeof(struct entry_stream)))) GOTOERROR;
+			files=temp;
 		}
-	// if S_ISREG
+		entry=&files[filecount];
+		if (!(entry->name=strdup_blockmem(&names,de->d_name))) GOTOERROR;
+		entry->meta.mode=statbuf.st_mode;
+		entry->meta.size=statbuf.st_size;
+		entry->meta.mtime=mtime;
+		entry->meta.dev=statbuf.st_dev;
+		entry->meta.ino=statbuf.st_ino;
+		entry->meta.nlink=statbuf.st_nlink;
+		filecount+=1;
 	} else if (S_ISDIR(statbuf.st_mode)) {
-		struct dir_bitrot *ndb;
-		if (isnothingnew) {
-			ndb=filename_find2_dirbyname(db->children.topnode,de->d_name);
-			if (ndb) {
-				ndb->flags|=ISFOUND_FLAG_BITROT;
-				if (scandirB(b,ndb,dir,de->d_name)) GOTOERROR;
-			} else {
-				if (isverbose) {
-					(void)unprintprogress(b);
-					if (0>fputs("skipping new directory: ",msgout)) GOTOERROR;
-					if (printpath(db,msgout)) GOTOERROR;
-					if (0>fputs(de->d_name,msgout)) GOTOERROR;
-					if (0>fputc('\n',msgout)) GOTOERROR;
-				}
-			}
-		} else {
-			if (findoradd_dir(&ndb,b,db,de->d_name,ISFOUND_FLAG_BITROT)) GOTOERROR;
-			if (scandirB(b,ndb,dir,de->d_name)) GOTOERROR;
+		if (dircount==dirmax) {
+			char **temp;
+			dirmax=dirmax*2+64;
+			if (!(temp=realloc(dirs,dirmax*sizeof(char *)))) GOTOERROR;
+			dirs=temp;
 		}
-	// if S_ISDIR
-	} else { // special file
+		if (!(dirs[dircount]=strdup_blockmem(&names,de->d_name))) GOTOERROR;
+		dircount+=1;
+	} else {
 		if (isverbose) {
-			(void)unprintprogress(b);
-			if (0>fputs("ignoring special: ",msgout)) GOTOERROR;
-			if (printpath(db,msgout)) GOTOERROR;
-			if (0>fputs(de->d_name,msgout)) GOTOERROR;
-			if (0>fputc('\n',msgout)) GOTOERROR;
+			if (printentry(b,"ignoring special: ",db,de->d_name)) GOTOERROR;
 		}
 		if (b->options.isprogress) {
 			(void)printprogress(b,0,de->d_name);
@@ -814,25 +3485,132 @@ while (1) {
 	}
 }
 
+if (dircount) qsort(dirs,dircount,sizeof(char *),cmpdirs_stream);
+if (filecount) qsort(files,filecount,sizeof(struct entry_stream),cmpfiles_stream);
+
+for (i=0;i<dircount;i++) {
+	struct dir_bitrot child;
+	unsigned int pathlen;
+	char *rest;
+	if (skipdirs_stream(s,dirs[i])) GOTOERROR;
+	if (b->options.isnothingnew) {
+		char *slash;
+		rest=under_stream(s);
+		if (!rest || !(slash=strchr(rest,'/')) || cmpcomponent(rest,slash-rest,dirs[i])) {
+			if (isverbose) {
+				if (printentry(b,"skipping new directory: ",db,dirs[i])) GOTOERROR;
+			}
+			continue;
+		}
+	}
+	clear_dir_bitrot(&child);
+	child.parent=db;
+	child.name=dirs[i];
+	pathlen=w->pathlen;
+	if (addpath_writer(w,dirs[i])) GOTOERROR;
+	if (streamdirB(b,s,&child,dirfd(dir),dirs[i])) GOTOERROR;
+	w->pathlen=pathlen;
+}
+if (skipdirs_stream(s,NULL)) GOTOERROR;
+
+for (i=0;i<filecount;i++) {
+	if (streamfile(b,s,db,dirfd(dir),&files[i])) GOTOERROR;
+}
+if (skipfiles_stream(s,NULL)) GOTOERROR;
+
+iffree(dirs);
+iffree(files);
+deinit_blockmem(&names);
 (ignore)closedir(dir);
 return 0;
 error:
+	iffree(dirs);
+	iffree(files);
+	deinit_blockmem(&names);
 	if (dir) closedir(dir);
 	return -1;
 }
 
-int scandir_bitrot(struct bitrot *b, char *dirname) {
-if (scandirB(b,&b->topdir,NULL,dirname)) GOTOERROR;
+int stream_bitrot(struct bitrot *b, char *sumfile, char *dirname) {
+// merge-joins the sorted catalog with a sorted scan, writing the new catalog as it goes
+struct stream_bitrot s;
+char *tempname=NULL,*realname=NULL,*logname=NULL;
+int fd=-1;
+
+memset(&s,0,sizeof(s));
+s.writer.fd=-1;
+s.sumfile=sumfile;
+b->sumfile.name=sumfile;
+
+if (!(logname=malloc(strlen(sumfile)+5))) GOTOERROR;
+sprintf(logname,"%s.log",sumfile);
+if (!access(logname,F_OK)) {
+	fprintf(stderr,"%s:%d %s has a changelog, run once with --compact before using --stream\n",__FILE__,__LINE__,sumfile);
+	GOTOERROR;
+}
+
+if (!(s.ff=fopen(sumfile,"r"))) {
+	if (errno!=ENOENT) GOTOERROR;
+} else {
+	struct stat statbuf;
+	if (fstat(fileno(s.ff),&statbuf)) GOTOERROR;
+#ifdef LINUX
+	b->sumfile.mtime=statbuf.st_mtim.tv_sec;
+#elif OSX
+	b->sumfile.mtime=statbuf.st_mtimespec.tv_sec;
+#endif 
+}
+if (!(s.line=malloc(MAXLINELEN))) GOTOERROR;
+if (!(s.prevline=malloc(MAXLINELEN))) GOTOERROR;
+
+if (!b->options.isdryrun) {
+	realname=resolvesumfile(sumfile);
+	if (opentemp(&fd,&tempname,realname?realname:sumfile)) GOTOERROR;
+}
+if (init_writer(&s.writer,fd)) GOTOERROR;
+
+if (next_stream(&s)) GOTOERROR;
+if (streamdirB(b,&s,&b->topdir,-1,dirname)) GOTOERROR;
+if (flush_writer(&s.writer)) GOTOERROR;
+
+if (!b->options.isdryrun) {
+	fd=-1;
+	if (b->stats.changecount) {
+		if (committemp(s.writer.fd,tempname,realname?realname:sumfile)) GOTOERROR;
+	} else {
+		(ignore)close(s.writer.fd);
+		(ignore)unlink(tempname);
+	}
+	free(tempname);
+	tempname=NULL;
+}
+
+deinit_writer(&s.writer);
+iffree(s.line);
+iffree(s.prevline);
+iffclose(s.ff);
+iffree(realname);
+free(logname);
 return 0;
 error:
+	deinit_writer(&s.writer);
+	iffree(s.line);
+	iffree(s.prevline);
+	iffclose(s.ff);
+	ifclose(fd);
+	if (tempname) {
+		(ignore)unlink(tempname);
+		free(tempname);
+	}
+	iffree(realname);
+	iffree(logname);
 	return -1;
 }
 
 CLEARFUNC(tarvars_bitrot);
 
-int init_tarvars_bitrot(struct tarvars_bitrot *tb) {
-unsigned char *bytes;
-bytes=tb->header.bytes;
+static void setfields_tarvars(struct tarvars_bitrot *tb, unsigned char *bytes) {
+// bytes is either header.bytes or a whole header in the input
 tb->header.fields.f_name=bytes+0;
 tb->header.fields.f_mode=bytes+100;
 tb->header.fields.f_uid=bytes+108;
@@ -849,11 +3627,16 @@ tb->header.fields.f_gname=bytes+297;
 tb->header.fields.f_devmajor=bytes+329;
 tb->header.fields.f_devminor=bytes+337;
 tb->header.fields.f_prefix=bytes+345;
+}
+
+int init_tarvars_bitrot(struct tarvars_bitrot *tb) {
+(void)setfields_tarvars(tb,tb->header.bytes);
 
 tb->state=HEADER_STATE_TARVARS_BITROT;
 tb->header.bytesleft=512;
 
 if (!(tb->filename=malloc(MAX_FILENAME_TARVARS_BITROT+1))) GOTOERROR;
+if (!(tb->pax.linkpath=malloc(MAX_FILENAME_TARVARS_BITROT+1))) GOTOERROR;
 return 0;
 error:
 	return -1;
@@ -861,9 +3644,10 @@ error:
 
 void deinit_tarvars_bitrot(struct tarvars_bitrot *tb) {
 iffree(tb->filename);
+iffree(tb->pax.linkpath);
 }
 
-static uint64_t octal12tou64(unsigned char *str) {
+static uint64_t slow_octal12tou64(unsigned char *str) {
 // reads at most 12 bytes
 uint64_t u64;
 switch (*str) {
@@ -891,144 +3675,752 @@ while (1) {
 		case '7': u64=u64*8+7; break;
 		default: return u64;
 	}
-	if (str==strlast) return u64;
-	str++;
+	if (str==strlast) return u64;
+	str++;
+}
+}
+
+static inline int isoctal(unsigned char c) {
+return (c&0xf8)=='0';
+}
+
+static inline uint64_t octal12tou64(unsigned char *str) {
+// the usual field is 11 digits and a terminator, decode the first 8 digits together
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__)
+uint64_t u64;
+memcpy(&u64,str,8);
+if (((u64&0xf8f8f8f8f8f8f8f8)==0x3030303030303030) && isoctal(str[8]) && isoctal(str[9]) && isoctal(str[10]) && !isoctal(str[11])) {
+	u64-=0x3030303030303030;
+	u64=(u64&0x00ff00ff00ff00ff)*8+((u64>>8)&0x00ff00ff00ff00ff); // the first digit is in the low byte
+	u64=(u64&0x0000ffff0000ffff)*64+((u64>>16)&0x0000ffff0000ffff);
+	u64=(u64&0xffffffff)*4096+(u64>>32);
+	return u64*512+(str[8]-'0')*64+(str[9]-'0')*8+(str[10]-'0');
+}
+#endif
+return slow_octal12tou64(str);
+}
+
+static uint64_t base256tou64(unsigned char *str) {
+// gnu's numbers that don't fit in octal: 0x80 then big-endian, 0xff is negative
+uint64_t u64=0;
+int i;
+if (*str==0xff) return 0;
+for (i=1;i<12;i++) u64=(u64<<8)|str[i];
+return u64;
+}
+
+static inline int isustar_tarvars(unsigned char *magic) {
+// posix is "ustar\0" then "00", gnu's "ustar  \0" keeps other fields where the prefix would be
+static const unsigned char ustar[8]={'u','s','t','a','r',0,0,0};
+static const unsigned char mask[8]={0xff,0xff,0xff,0xff,0xff,0xff,0,0};
+uint64_t u64,ustar64,mask64;
+memcpy(&u64,magic,8);
+memcpy(&ustar64,ustar,8);
+memcpy(&mask64,mask,8);
+return (u64&mask64)==ustar64;
+}
+
+static void parsefields_tarvars(struct tarvars_bitrot *tb) {
+// old v7 files have no magic at all, anything is accepted
+if (*tb->header.fields.f_size&0x80) tb->header.parsed.size=base256tou64(tb->header.fields.f_size);
+else tb->header.parsed.size=octal12tou64(tb->header.fields.f_size);
+if (*tb->header.fields.f_mtime&0x80) tb->header.parsed.mtime=base256tou64(tb->header.fields.f_mtime);
+else tb->header.parsed.mtime=octal12tou64(tb->header.fields.f_mtime);
+tb->header.parsed.isustar=isustar_tarvars(tb->header.fields.f_magic);
+}
+
+static inline int is512zeros(void *p) {
+// headers fail on the first word, end blocks are or'd 64 bytes at a time
+unsigned char *bytes=p;
+uint64_t u64s[8];
+int i,j;
+memcpy(u64s,bytes,8);
+if (u64s[0]) return 0;
+for (i=0;i<512;i+=64) {
+	uint64_t acc=0;
+	memcpy(u64s,bytes+i,64);
+	for (j=0;j<8;j++) acc|=u64s[j];
+	if (acc) return 0;
+}
+return 1;
+}
+
+static inline int ismeta_scantar(struct tarvars_bitrot *tb) {
+// these describe the next member instead of being one
+switch (*tb->header.fields.f_typeflag) {
+	case 'x': case 'g': case 'X': // pax, 'X' is the older solaris spelling
+	case 'L': case 'K': // gnu long names
+		return 1;
+}
+return 0;
+}
+
+static void applypax_scantar(struct tarvars_bitrot *tb) {
+// pax records override the header of the member that follows them
+if (tb->pax.global.hasmtime) tb->header.parsed.mtime=tb->pax.global.mtime;
+if (tb->pax.hasmtime) tb->header.parsed.mtime=tb->pax.mtime;
+if (tb->pax.hassize) tb->header.parsed.size=tb->pax.size;
+if (tb->pax.haspath) tb->header.parsed.filetype=LONGLINK_FILETYPE_TARVARS_BITROT; // already in tb->filename
+tb->header.parsed.islinkpath=tb->pax.haslinkpath;
+tb->pax.haspath=tb->pax.haslinkpath=tb->pax.hassize=tb->pax.hasmtime=0;
+}
+
+static int header_scantar(unsigned int *consumed_out,
+		struct bitrot *b, struct tarvars_bitrot *tb, unsigned char *bytes, unsigned int len) {
+unsigned int bytesleft;
+
+bytesleft=tb->header.bytesleft;
+if (bytesleft==512) tb->header.offset=tb->offset;
+if (len<bytesleft) { // staying in header_
+	memcpy(tb->header.bytes+512-bytesleft,bytes,len);
+	tb->header.bytesleft=bytesleft-len;
+	*consumed_out=len;
+} else {
+	if (bytesleft==512) { // the whole header is in bytes, scantar_bitrot considers it before bytes can go away
+		(void)setfields_tarvars(tb,bytes);
+	} else {
+		memcpy(tb->header.bytes+512-bytesleft,bytes,bytesleft);
+		(void)setfields_tarvars(tb,tb->header.bytes);
+	}
+	if (is512zeros(tb->header.fields.f_name)) {
+		tb->state=ENDBLOCKS_STATE_TARVARS_BITROT;
+		tb->endblocks.bytesleft=512;
+		*consumed_out=bytesleft;
+	} else {
+		(void)parsefields_tarvars(tb);
+		if (!ismeta_scantar(tb)) (void)applypax_scantar(tb);
+		tb->state=CONSIDER_STATE_TARVARS_BITROT;
+		*consumed_out=bytesleft;
+	}
+}
+return 0;
+}
+
+static inline int isregular_scantar(struct tarvars_bitrot *tb) {
+// note: in old (non-magic) files, dirs also have typeflag='0' and are distinguished by '/' tails in f_name
+if (*tb->header.fields.f_typeflag=='0') return 1; // regular file, or old-style directory as well
+if (*tb->header.fields.f_typeflag=='7') return 1; // contiguous file
+if (*tb->header.fields.f_typeflag==0) return 1; // supported alternative
+return 0;
+}
+static inline int ishardlink_scantar(struct tarvars_bitrot *tb) {
+if (*tb->header.fields.f_typeflag=='1') return 1; // hard link to an earlier member, no data
+return 0;
+}
+static inline int islonglink_scantar(struct tarvars_bitrot *tb) {
+if (*tb->header.fields.f_typeflag=='L') return 1; // GNU LongLink
+return 0;
+}
+static inline int islonglinkname_scantar(struct tarvars_bitrot *tb) {
+if (*tb->header.fields.f_typeflag=='K') return 1; // GNU LongLink for the next member's linkname
+return 0;
+}
+static inline int ispax_scantar(struct tarvars_bitrot *tb) {
+switch (*tb->header.fields.f_typeflag) {
+	case 'x': case 'g': case 'X': return 1;
+}
+return 0;
+}
+static inline int isignored_scantar(struct bitrot *b, struct tarvars_bitrot *tb) {
+if (tb->header.parsed.mtime>b->options.ceiling_mtime) return 1;
+return 0;
+}
+
+static struct file_bitrot *unsafe_findfile(struct bitrot *b, char *filename) {
+// unsafe_: this will edit filename but change it back
+struct dir_bitrot *dir;
+struct file_bitrot *file;
+
+(ignore)resolve_cursor(&dir,&filename,&b->cursors.find,NULL,&b->topdir,filename,0,0); // can't fail without adding
+if (!dir) return NULL;
+file=filename_find2_filebyname(dir->files.topnode,filename);
+return file;
+}
+
+static inline void getfullpath_tarvars(char *dest, struct tarvars_bitrot *tb) {
+// dest should be 257 chars
+unsigned int namelen=100,prefixlen=155;
+unsigned char *name,*prefix;
+name=tb->header.fields.f_name;
+prefix=tb->header.fields.f_prefix;
+if (tb->header.parsed.isustar && *prefix) {
+	while (1) {
+		*dest=*prefix;
+		dest++;
+		prefixlen--;
+		if (!prefixlen) break;
+		prefix++;
+		if (!*prefix) break;
+	}
+	*dest='/';
+	dest++;
+}
+
+while (1) {
+	if (!*name) break;
+	*dest=*name;
+	dest++;
+	namelen--;
+	if (!namelen) break;
+	name++;
+}
+*dest=0;
+}
+
+
+static int addindex_scantar(struct bitrot *b, char *fullpath, uint64_t headeroffset, uint64_t size, unsigned char *md5) {
+// "md5  headeroffset dataoffset size path", hardlinks have no data and aren't listed
+unsigned char hex[LEN_MD5_BITROT*2+2];
+(void)sethexbuff(hex,md5,LEN_MD5_BITROT);
+if (1!=fwrite(hex,LEN_MD5_BITROT*2+2,1,b->tarindex.fout)) GOTOERROR;
+if (0>fprintf(b->tarindex.fout,"%"PRIu64" %"PRIu64" %"PRIu64" %s\n",headeroffset,headeroffset+512,size,fullpath)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+struct slice_tar {
+	struct slice_tar *next;
+	unsigned char *bytes; // in the ring
+	unsigned int len;
+	unsigned int slot;
+};
+
+struct member_tar { // with --threads, a file hashed by a worker and finished in tar order
+	struct member_tar *next; // finish queue
+	struct member_tar *nextready;
+	struct slice_tar *first,*last; // data waiting to be hashed, in order
+	MD5_CTX ctx;
+	unsigned char md5[LEN_MD5_BITROT];
+	char *filename;
+	uint64_t mtime;
+	uint64_t headeroffset,size; // for --index
+	int ishardlink;
+	int isbusy,isready,isclosed,isdone;
+};
+
+#define NONE_FORMAT_INFLATE	0
+#define GZIP_FORMAT_INFLATE	1
+#define XZ_FORMAT_INFLATE	2
+#define ZSTD_FORMAT_INFLATE	3
+
+struct inflate_ring { // compressed tar data is decompressed by the reader
+	int format;
+	unsigned int threads; // for xz
+	unsigned char *input; // READCHUNK_BITROT of compressed data, as it was read and relayed
+	unsigned char *in;
+	unsigned int inleft;
+	int isinputeof;
+	int isend; // at the end of a gzip member or xz/zstd frame, so the input could end here
+	int ispending; // the decompressor filled the output and could have more without more input
+	int isgarbage; // trailing bytes after the last frame are relayed but not decompressed
+#ifdef USEZLIB
+	z_stream zs;
+	int iszs;
+#endif
+#ifdef USELZMA
+	lzma_stream xs;
+	int isxs;
+#endif
+#ifdef USEZSTD
+	ZSTD_DStream *zds;
+#endif
+};
+
+#define MAGICLEN_INFLATE	6 // xz's, the longest
+static int getformat_inflate(unsigned char *bytes, unsigned int len) {
+// by magic bytes, a tar header starts with a filename so it won't match these
+static unsigned char gzipmagic[]={0x1f,0x8b};
+static unsigned char xzmagic[]={0xfd,'7','z','X','Z',0};
+static unsigned char zstdmagic[]={0x28,0xb5,0x2f,0xfd};
+if ((len>=sizeof(gzipmagic)) && !memcmp(bytes,gzipmagic,sizeof(gzipmagic))) return GZIP_FORMAT_INFLATE;
+if ((len>=sizeof(xzmagic)) && !memcmp(bytes,xzmagic,sizeof(xzmagic))) return XZ_FORMAT_INFLATE;
+if ((len>=sizeof(zstdmagic)) && !memcmp(bytes,zstdmagic,sizeof(zstdmagic))) return ZSTD_FORMAT_INFLATE;
+return NONE_FORMAT_INFLATE;
+}
+
+#ifdef USELZMA
+static int initxz_inflate(struct inflate_ring *z) {
+lzma_ret rc;
+#if LZMA_VERSION >= 50040002
+if (z->threads>1) { // only helps with files that xz -T wrote in blocks
+	lzma_mt mt;
+	memset(&mt,0,sizeof(mt));
+	mt.threads=z->threads;
+	mt.memlimit_threading=lzma_physmem()/4;
+	mt.memlimit_stop=UINT64_MAX;
+	rc=lzma_stream_decoder_mt(&z->xs,&mt);
+} else
+#endif
+rc=lzma_stream_decoder(&z->xs,UINT64_MAX,0);
+if (rc!=LZMA_OK) GOTOERROR;
+z->isxs=1;
+return 0;
+error:
+	return -1;
+}
+#endif
+
+static int init_inflate(struct inflate_ring *z, int format) {
+z->format=format;
+if (!(z->input=malloc(READCHUNK_BITROT))) GOTOERROR;
+switch (format) {
+	case GZIP_FORMAT_INFLATE:
+#ifdef USEZLIB
+		if (Z_OK!=inflateInit2(&z->zs,15+16)) GOTOERROR; // gzip header
+		z->iszs=1;
+		break;
+#else
+		fprintf(stderr,"%s:%d tar data is gzip compressed, build with -DUSEZLIB or use zcat\n",__FILE__,__LINE__);
+		GOTOERROR;
+#endif
+	case XZ_FORMAT_INFLATE:
+#ifdef USELZMA
+		if (initxz_inflate(z)) GOTOERROR;
+		break;
+#else
+		fprintf(stderr,"%s:%d tar data is xz compressed, build with -DUSELZMA or use xzcat\n",__FILE__,__LINE__);
+		GOTOERROR;
+#endif
+	case ZSTD_FORMAT_INFLATE:
+#ifdef USEZSTD
+		if (!(z->zds=ZSTD_createDStream())) GOTOERROR;
+		if (ZSTD_isError(ZSTD_initDStream(z->zds))) GOTOERROR;
+		break;
+#else
+		fprintf(stderr,"%s:%d tar data is zstd compressed, build with -DUSEZSTD or use zstdcat\n",__FILE__,__LINE__);
+		GOTOERROR;
+#endif
+}
+return 0;
+error:
+	return -1;
+}
+
+static void deinit_inflate(struct inflate_ring *z) {
+#ifdef USEZLIB
+if (z->iszs) (ignore)inflateEnd(&z->zs);
+#endif
+#ifdef USELZMA
+if (z->isxs) lzma_end(&z->xs);
+#endif
+#ifdef USEZSTD
+if (z->zds) (ignore)ZSTD_freeDStream(z->zds);
+#endif
+iffree(z->input);
+}
+
+static int nextframe_inflate(struct inflate_ring *z) {
+// after a gzip member or an xz stream, another one could follow, e.g. from pigz or cat a.gz b.gz
+static unsigned char firstbytes[]={0,0x1f,0xfd,0x28};
+while (z->inleft && !*z->in) { // xz stream padding, or zeros a tool added to fill a block
+	z->in+=1;
+	z->inleft-=1;
+}
+if (!z->inleft) return 0;
+if (*z->in!=firstbytes[z->format]) {
+	z->isgarbage=1;
+	return 0;
+}
+switch (z->format) {
+#ifdef USEZLIB
+	case GZIP_FORMAT_INFLATE:
+		if (Z_OK!=inflateReset(&z->zs)) GOTOERROR;
+		break;
+#endif
+#ifdef USELZMA
+	case XZ_FORMAT_INFLATE:
+		if (initxz_inflate(z)) GOTOERROR; // lzma_*decoder() reuses the stream's memory
+		break;
+#endif
+	case ZSTD_FORMAT_INFLATE: break; // the dstream starts the next frame by itself
+	default: GOTOERROR;
+}
+z->isend=0;
+return 0;
+error:
+	return -1;
+}
+
+static int step_inflate(struct inflate_ring *z, unsigned char **out_inout, unsigned int *outleft_inout) {
+// decompresses what it can of z->in into out, advancing both
+switch (z->format) {
+#ifdef USEZLIB
+	case GZIP_FORMAT_INFLATE:
+	{
+		z_stream *zs=&z->zs;
+		int rc;
+		zs->next_in=z->in;
+		zs->avail_in=z->inleft;
+		zs->next_out=*out_inout;
+		zs->avail_out=*outleft_inout;
+		rc=inflate(zs,Z_NO_FLUSH);
+		z->in=zs->next_in;
+		z->inleft=zs->avail_in;
+		*out_inout=zs->next_out;
+		*outleft_inout=zs->avail_out;
+		if (rc==Z_STREAM_END) {
+			z->isend=1;
+		} else if ((rc!=Z_OK) && (rc!=Z_BUF_ERROR)) {
+			fprintf(stderr,"%s:%d error decompressing gzip data (%s)\n",__FILE__,__LINE__,zs->msg?zs->msg:"");
+			GOTOERROR;
+		}
+	}
+		break;
+#endif
+#ifdef USELZMA
+	case XZ_FORMAT_INFLATE:
+	{
+		lzma_stream *xs=&z->xs;
+		lzma_ret rc;
+		xs->next_in=z->in;
+		xs->avail_in=z->inleft;
+		xs->next_out=*out_inout;
+		xs->avail_out=*outleft_inout;
+		rc=lzma_code(xs,LZMA_RUN);
+		z->in=(unsigned char *)xs->next_in;
+		z->inleft=xs->avail_in;
+		*out_inout=xs->next_out;
+		*outleft_inout=xs->avail_out;
+		if (rc==LZMA_STREAM_END) {
+			z->isend=1;
+		} else if ((rc!=LZMA_OK) && (rc!=LZMA_BUF_ERROR)) {
+			fprintf(stderr,"%s:%d error decompressing xz data (%u)\n",__FILE__,__LINE__,rc);
+			GOTOERROR;
+		}
+	}
+		break;
+#endif
+#ifdef USEZSTD
+	case ZSTD_FORMAT_INFLATE:
+	{
+		ZSTD_inBuffer zin;
+		ZSTD_outBuffer zout;
+		size_t rc;
+		zin.src=z->in;
+		zin.size=z->inleft;
+		zin.pos=0;
+		zout.dst=*out_inout;
+		zout.size=*outleft_inout;
+		zout.pos=0;
+		rc=ZSTD_decompressStream(z->zds,&zout,&zin);
+		if (ZSTD_isError(rc)) {
+			fprintf(stderr,"%s:%d error decompressing zstd data (%s)\n",__FILE__,__LINE__,ZSTD_getErrorName(rc));
+			GOTOERROR;
+		}
+		z->in+=zin.pos;
+		z->inleft-=zin.pos;
+		*out_inout+=zout.pos;
+		*outleft_inout-=zout.pos;
+		z->isend=!rc; // frames follow each other without a reset
+	}
+		break;
+#endif
+	default: GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
+
+struct ring_tar {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned char *buffer; // slots chunks of READCHUNK_BITROT
+	unsigned int slots;
+	unsigned int *lens;
+	unsigned int *refs; // slices in each chunk that haven't been hashed
+	unsigned int head,tail,freetail; // the reader fills head, the scanner empties tail, chunks before freetail are free
+	int fdin,fdout;
+	int istee; // both are pipes, relay with tee() instead of write()
+	int isteed; // tee() has worked, so a later failure is a real error
+	int ischecked; // the first bytes were checked for compression
+	struct inflate_ring inflate;
+	int iseof,iserror,isquit;
+	struct {
+		unsigned int slot; // chunk being scanned
+		struct member_tar *current; // getting slices
+		struct member_tar *first,*last; // waiting to be finished
+		struct member_tar *readyfirst,*readylast; // have slices and no worker
+		struct slice_tar *freeslices;
+		pthread_t *workers;
+		unsigned int nworkers;
+		int iserror;
+	} pool;
+};
+
+static void freetail_ring(struct ring_tar *r) {
+// with the mutex, chunks are reused in order once they're scanned and hashed
+while ((r->freetail!=r->tail) && !r->refs[r->freetail%r->slots]) r->freetail+=1;
+}
+
+static void ready_pool(struct ring_tar *r, struct member_tar *m) {
+// with the mutex
+if (m->isbusy || m->isready) return;
+m->isready=1;
+m->nextready=NULL;
+if (r->pool.readylast) r->pool.readylast->nextready=m;
+else r->pool.readyfirst=m;
+r->pool.readylast=m;
+}
+
+static int finalize_pool(struct member_tar *m) {
+#ifdef OPENSSL
+if (1!=MD5_Final(m->md5,&m->ctx)) GOTOERROR;
+#elif GNUTLS
+(void)MD5_Final(m->md5,&m->ctx);
+#else
+(void)finish_context_md5(m->md5,&m->ctx);
+#endif
+m->isdone=1;
+return 0;
+#ifdef OPENSSL
+error:
+	return -1;
+#endif
+}
+
+static void *worker_pool(void *arg) {
+// hashes the slices of one member at a time, so each md5 sees its data in order
+struct ring_tar *r=arg;
+(ignore)pthread_mutex_lock(&r->mutex);
+while (1) {
+	struct member_tar *m;
+	struct slice_tar *slices,*s;
+	int iserror=0;
+	if (!r->pool.readyfirst) {
+		if (r->isquit) break;
+		(ignore)pthread_cond_wait(&r->cond,&r->mutex);
+		continue;
+	}
+	m=r->pool.readyfirst;
+	r->pool.readyfirst=m->nextready;
+	if (!r->pool.readyfirst) r->pool.readylast=NULL;
+	m->isready=0;
+	m->isbusy=1;
+	slices=m->first;
+	m->first=m->last=NULL;
+	(ignore)pthread_mutex_unlock(&r->mutex);
+
+	for (s=slices;s;s=s->next) {
+#ifdef OPENSSL
+		if (1!=MD5_Update(&m->ctx,s->bytes,s->len)) iserror=1;
+#elif GNUTLS
+		(void)MD5_Update(&m->ctx,s->bytes,s->len);
+#else
+		(void)addbytes_context_md5(&m->ctx,s->bytes,s->len);
+#endif
+	}
+
+	(ignore)pthread_mutex_lock(&r->mutex);
+	while (slices) {
+		s=slices;
+		slices=s->next;
+		r->refs[s->slot%r->slots]-=1;
+		s->next=r->pool.freeslices;
+		r->pool.freeslices=s;
+	}
+	(void)freetail_ring(r);
+	m->isbusy=0;
+	if (m->first) {
+		(void)ready_pool(r,m);
+	} else if (m->isclosed) {
+		if (finalize_pool(m)) iserror=1;
+	}
+	if (iserror) r->pool.iserror=1;
+	(ignore)pthread_cond_broadcast(&r->cond);
 }
+(ignore)pthread_mutex_unlock(&r->mutex);
+return NULL;
 }
 
-static int parsefields_tarvars(struct tarvars_bitrot *tb) {
-unsigned char gnumagic[]={'u','s','t','a','r',' ',' ',0};
-unsigned char posix1988[]={'u','s','t','a','r',0,'0','0'};
-tb->header.parsed.namelen=strnlen((char *)tb->header.fields.f_name,100);
-tb->header.parsed.size=octal12tou64(tb->header.fields.f_size);
-tb->header.parsed.mtime=octal12tou64(tb->header.fields.f_mtime);
-if (memcmp(tb->header.fields.f_magic,gnumagic,8)) {
-} else if (memcmp(tb->header.fields.f_magic,posix1988,8)) {
+static int open_pool(struct ring_tar *r, struct tarvars_bitrot *tb, unsigned char *md5) {
+// queues the current member to be finished, md5 is NULL if its data is coming with addslice_pool
+struct member_tar *m;
+if (!(m=malloc(sizeof(struct member_tar)))) GOTOERROR;
+memset(m,0,sizeof(struct member_tar));
+if (!(m->filename=strdup(tb->filename))) {
+	free(m);
+	GOTOERROR;
+}
+m->mtime=tb->header.parsed.mtime;
+m->headeroffset=tb->header.offset;
+m->size=tb->header.parsed.size;
+m->ishardlink=tb->header.parsed.ishardlink;
+if (md5) {
+	memcpy(m->md5,md5,LEN_MD5_BITROT);
+	m->isclosed=1;
+	m->isdone=1;
 } else {
-	int i;
-	fprintf(stderr,"%s:%d file has unsupported magic value/format ",__FILE__,__LINE__);
-	for (i=0;i<8;i++) {
-		fprintf(stderr,"%02x",tb->header.fields.f_magic[i]);
+#ifdef OPENSSL
+	if (1!=MD5_Init(&m->ctx)) {
+		free(m->filename);
+		free(m);
+		GOTOERROR;
 	}
-	fprintf(stderr,"\n");
-	GOTOERROR;
+#elif GNUTLS
+	(void)MD5_Init(&m->ctx);
+#else
+	(void)clear_context_md5(&m->ctx);
+#endif
+	r->pool.current=m;
 }
-tb->header.parsed.prefixlen=strnlen((char *)tb->header.fields.f_name,155);
+(ignore)pthread_mutex_lock(&r->mutex);
+if (r->pool.last) r->pool.last->next=m;
+else r->pool.first=m;
+r->pool.last=m;
+(ignore)pthread_mutex_unlock(&r->mutex);
 return 0;
 error:
 	return -1;
 }
 
-static inline int is512zeros(void *p) {
-uint64_t *u64s;
-int i;
-u64s=p;
-for (i=64;i>0;i--) {
-	if (*u64s) return 0;
-	u64s+=1;
+static int addslice_pool(struct ring_tar *r, unsigned char *bytes, unsigned int len) {
+struct member_tar *m=r->pool.current;
+struct slice_tar *s;
+(ignore)pthread_mutex_lock(&r->mutex);
+s=r->pool.freeslices;
+if (s) {
+	r->pool.freeslices=s->next;
+} else if (!(s=malloc(sizeof(struct slice_tar)))) {
+	(ignore)pthread_mutex_unlock(&r->mutex);
+	GOTOERROR;
 }
-return 1;
+s->next=NULL;
+s->bytes=bytes;
+s->len=len;
+s->slot=r->pool.slot;
+if (m->last) m->last->next=s;
+else m->first=s;
+m->last=s;
+r->refs[s->slot%r->slots]+=1;
+(void)ready_pool(r,m);
+(ignore)pthread_cond_broadcast(&r->cond);
+(ignore)pthread_mutex_unlock(&r->mutex);
+return 0;
+error:
+	return -1;
 }
 
-static int header_scantar(unsigned int *consumed_out,
-		struct bitrot *b, struct tarvars_bitrot *tb, unsigned char *bytes, unsigned int len) {
-unsigned int bytesleft;
-
-bytesleft=tb->header.bytesleft;
-if (len<bytesleft) { // staying in header_
-	memcpy(tb->header.bytes+512-bytesleft,bytes,len);
-	tb->header.bytesleft=bytesleft-len;
-	*consumed_out=len;
-} else {
-	memcpy(tb->header.bytes+512-bytesleft,bytes,bytesleft);
-	if (is512zeros(tb->header.bytes)) {
-		tb->state=ENDBLOCKS_STATE_TARVARS_BITROT;
-		tb->endblocks.bytesleft=512;
-		*consumed_out=bytesleft;
-	} else {
-		if (parsefields_tarvars(tb)) GOTOERROR;
-		tb->state=CONSIDER_STATE_TARVARS_BITROT;
-		*consumed_out=bytesleft;
-	}
+static int close_pool(struct ring_tar *r) {
+// no more slices for the current member
+struct member_tar *m=r->pool.current;
+int iserror=0;
+r->pool.current=NULL;
+(ignore)pthread_mutex_lock(&r->mutex);
+m->isclosed=1;
+if (!m->isbusy && !m->first) {
+	if (finalize_pool(m)) iserror=1;
+	(ignore)pthread_cond_broadcast(&r->cond);
 }
+(ignore)pthread_mutex_unlock(&r->mutex);
+if (iserror) GOTOERROR;
 return 0;
 error:
 	return -1;
 }
 
-static inline int isregular_scantar(struct tarvars_bitrot *tb) {
-// note: in old (non-magic) files, dirs also have typeflag='0' and are distinguished by '/' tails in f_name
-if (*tb->header.fields.f_typeflag=='0') return 1; // regular file, or old-style directory as well
-if (*tb->header.fields.f_typeflag=='7') return 1; // contiguous file
-if (*tb->header.fields.f_typeflag==0) return 1; // supported alternative
-return 0;
+static int finishfile_scantar(struct bitrot *b, char *fullpath, uint64_t mtime, unsigned char *md5);
+static int reconcile_pool(struct bitrot *b, struct ring_tar *r, int iswait) {
+// finishes members in tar order as their md5s come in, iswait to finish all of them
+while (1) {
+	struct member_tar *m;
+	int rr;
+	(ignore)pthread_mutex_lock(&r->mutex);
+	while (1) {
+		m=r->pool.first;
+		if (!m || m->isdone || !iswait || r->pool.iserror) break;
+		(ignore)pthread_cond_wait(&r->cond,&r->mutex);
+	}
+	if (r->pool.iserror) {
+		(ignore)pthread_mutex_unlock(&r->mutex);
+		GOTOERROR;
+	}
+	if (!m || !m->isdone) {
+		(ignore)pthread_mutex_unlock(&r->mutex);
+		break;
+	}
+	r->pool.first=m->next;
+	if (!r->pool.first) r->pool.last=NULL;
+	(ignore)pthread_mutex_unlock(&r->mutex);
+	rr=finishfile_scantar(b,m->filename,m->mtime,m->md5);
+	if (!rr && b->tarindex.fout && !m->ishardlink) {
+		rr=addindex_scantar(b,m->filename,m->headeroffset,m->size,m->md5);
+	}
+	free(m->filename);
+	free(m);
+	if (rr) GOTOERROR;
 }
-static inline int islonglink_scantar(struct tarvars_bitrot *tb) {
-if (*tb->header.fields.f_typeflag=='L') return 1; // GNU LongLink
 return 0;
+error:
+	return -1;
+}
+
+static int startworkers_pool(struct ring_tar *r, unsigned int threads) {
+if (!(r->pool.workers=malloc(threads*sizeof(pthread_t)))) GOTOERROR;
+for (;r->pool.nworkers<threads;r->pool.nworkers++) {
+	if (pthread_create(&r->pool.workers[r->pool.nworkers],NULL,worker_pool,r)) GOTOERROR;
 }
-static inline int isignored_scantar(struct bitrot *b, struct tarvars_bitrot *tb) {
-if (tb->header.parsed.mtime>b->options.ceiling_mtime) return 1;
 return 0;
+error:
+	return -1;
 }
 
-static int unsafe_isexistingfile(struct bitrot *b, char *filename) {
-// unsafe_: this will edit filename but change it back
-struct dir_bitrot *dir;
-struct file_bitrot *file;
-
-dir=&b->topdir;
-while (1) {
-	char *slash;
-	slash=strchr(filename,'/');
-	if (!slash) break;
-	*slash=0;
-	if (!strcmp(filename,".")) {
-	} else {
-		dir=filename_find2_dirbyname(dir->children.topnode,filename);
-		if (!dir) {
-			*slash='/';
-			return 0;
-		}
-	}
-	*slash='/';
-	filename=slash+1;
+static void stopworkers_pool(struct ring_tar *r) {
+// workers finish their current member first, this also stops a reader
+(ignore)pthread_mutex_lock(&r->mutex);
+r->isquit=1;
+(ignore)pthread_cond_broadcast(&r->cond);
+(ignore)pthread_mutex_unlock(&r->mutex);
+while (r->pool.nworkers) {
+	r->pool.nworkers-=1;
+	(ignore)pthread_join(r->pool.workers[r->pool.nworkers],NULL);
 }
-file=filename_find2_filebyname(dir->files.topnode,filename);
-if (file) return 1;
-return 0;
+iffree(r->pool.workers);
 }
 
-static inline void getfullpath_tarvars(char *dest, struct tarvars_bitrot *tb) {
-// dest should be 257 chars
-unsigned int namelen=100,prefixlen=155;
-unsigned char *name,*prefix;
-name=tb->header.fields.f_name;
-prefix=tb->header.fields.f_prefix;
-if (*prefix) {
-	while (1) {
-		*dest=*prefix;
-		dest++;
-		prefixlen--;
-		if (!prefixlen) break;
-		prefix++;
-		if (!*prefix) break;
+static void deinit_pool(struct ring_tar *r) {
+// after the workers are joined
+while (r->pool.first) {
+	struct member_tar *m=r->pool.first;
+	r->pool.first=m->next;
+	while (m->first) {
+		struct slice_tar *s=m->first;
+		m->first=s->next;
+		free(s);
 	}
-	*dest='/';
-	dest++;
+	free(m->filename);
+	free(m);
 }
-
-while (1) {
-	if (!*name) break;
-	*dest=*name;
-	dest++;
-	namelen--;
-	if (!namelen) break;
-	name++;
+while (r->pool.freeslices) {
+	struct slice_tar *s=r->pool.freeslices;
+	r->pool.freeslices=s->next;
+	free(s);
 }
-*dest=0;
 }
 
+static int linkmd5_scantar(int *isfound_out, struct bitrot *b, struct tarvars_bitrot *tb) {
+// a hardlink gets the md5 of its target, which is an earlier member
+char linkname[101];
+struct file_bitrot *file;
+struct keyed_bitrot *k;
+
+if (tb->header.parsed.islinkpath) {
+	file=unsafe_findfile(b,tb->pax.linkpath);
+} else {
+	memcpy(linkname,tb->header.fields.f_linkname,100);
+	linkname[100]='\0';
+	file=unsafe_findfile(b,linkname);
+}
+if (!file || !(file->flags&ISFOUND_FLAG_BITROT)) { // target was skipped
+	*isfound_out=0;
+	return 0;
+}
+k=key_find2_bykey(b->hardlinks.mismatches,(uint64_t)(uintptr_t)file,0);
+memcpy(tb->checksum.md5,k?k->md5:file->md5,LEN_MD5_BITROT);
+*isfound_out=1;
+return 0;
+}
 
 static int consider_scantar(struct bitrot *b, struct tarvars_bitrot *tb, unsigned char *bytes, unsigned int len) {
 uint64_t size;
@@ -1040,16 +4432,16 @@ msgout=b->options.msgout;
 #if 0
 fprintf(stderr,"%s:%d",__FILE__,__LINE__);
 fputs(" name: ",stderr);
-fwrite(tb->header.fields.f_name,tb->header.parsed.namelen,1,stderr);
+fwrite(tb->header.fields.f_name,strnlen((char *)tb->header.fields.f_name,100),1,stderr);
 fputs(" prefix: ",stderr);
-fwrite(tb->header.fields.f_prefix,tb->header.parsed.prefixlen,1,stderr);
+fwrite(tb->header.fields.f_prefix,strnlen((char *)tb->header.fields.f_prefix,155),1,stderr);
 fprintf(stderr," size: %llu",tb->header.parsed.size);
 fprintf(stderr," mtime: %llu",tb->header.parsed.mtime);
 fprintf(stderr," typeflag: %u",*tb->header.fields.f_typeflag);
 fputs("\n",stderr);
 #endif
 
-if (isregular_scantar(tb) && !isignored_scantar(b,tb)) {
+if ((isregular_scantar(tb) || (ishardlink_scantar(tb) && !tb->header.parsed.size)) && !isignored_scantar(b,tb)) {
 	isworthy=1;
 	if (tb->header.parsed.filetype==LONGLINK_FILETYPE_TARVARS_BITROT) {
 // LONGLINK is already stored in tb->filename
@@ -1059,7 +4451,7 @@ if (isregular_scantar(tb) && !isignored_scantar(b,tb)) {
 #endif
 		(void)getfullpath_tarvars(tb->filename,tb);
 	} 
-	if (b->options.isnothingnew && !unsafe_isexistingfile(b,tb->filename)) {
+	if (b->options.isnothingnew && !unsafe_findfile(b,tb->filename)) {
 		isworthy=0;
 		if (b->options.isverbose) {
 			(void)unprintprogress(b);
@@ -1067,6 +4459,17 @@ if (isregular_scantar(tb) && !isignored_scantar(b,tb)) {
 			if (0>fputs(tb->filename,msgout)) GOTOERROR;
 			if (0>fputc('\n',msgout)) GOTOERROR;
 		}
+	} else if (ishardlink_scantar(tb)) {
+		if (tb->pool) { // the target could still be with a worker
+			if (reconcile_pool(b,tb->pool,1)) GOTOERROR;
+		}
+		if (linkmd5_scantar(&isworthy,b,tb)) GOTOERROR;
+		if (!isworthy && b->options.isverbose) {
+			(void)unprintprogress(b);
+			if (0>fputs("skipping hardlink: ",msgout)) GOTOERROR;
+			if (0>fputs(tb->filename,msgout)) GOTOERROR;
+			if (0>fputc('\n',msgout)) GOTOERROR;
+		}
 	}
 } else if (b->options.isprogress) {
 	// want full path for progress printing
@@ -1077,30 +4480,56 @@ if (isregular_scantar(tb) && !isignored_scantar(b,tb)) {
 }
 
 size=tb->header.parsed.size;
+tb->header.parsed.ishardlink=ishardlink_scantar(tb);
 if (isworthy) {
 	if (tb->header.parsed.filetype==LONGLINK_FILETYPE_TARVARS_BITROT) tb->header.parsed.filetype=LONGFILE_FILETYPE_TARVARS_BITROT;
 	else tb->header.parsed.filetype=REGULAR_FILETYPE_TARVARS_BITROT;
-	if (!size) {
+	if (ishardlink_scantar(tb)) { // linkmd5_scantar has set the md5
+		tb->state=ENDFILE_STATE_TARVARS_BITROT;
+		if (tb->pool) {
+			if (open_pool(tb->pool,tb,tb->checksum.md5)) GOTOERROR;
+		}
+	} else if (!size) {
 #if LEN_MD5_BITROT != 16
 #error
 #endif
 		tb->state=ENDFILE_STATE_TARVARS_BITROT;
 		memcpy(tb->checksum.md5,zeromd5,16);
+		if (tb->pool) {
+			if (open_pool(tb->pool,tb,tb->checksum.md5)) GOTOERROR;
+		}
 	} else {
 		tb->state=CHECKSUM_STATE_TARVARS_BITROT;
 		tb->checksum.inputbytesleft=((size-1)|511)+1;
 		tb->checksum.databytesleft=size;
+		if (tb->pool) {
+			if (open_pool(tb->pool,tb,NULL)) GOTOERROR;
+		} else {
 #ifdef OPENSSL
-		if (1!=MD5_Init(&tb->checksum.ctx)) GOTOERROR;
+			if (1!=MD5_Init(&tb->checksum.ctx)) GOTOERROR;
 #elif GNUTLS
-		(void)MD5_Init(&tb->checksum.ctx);
+			(void)MD5_Init(&tb->checksum.ctx);
 #else
-		(void)clear_context_md5(&tb->checksum.ctx);
+			(void)clear_context_md5(&tb->checksum.ctx);
 #endif
+		}
 		if (b->options.isprogress) {
 			(void)printprogress(b,1,tb->filename);
 		}
 	}
+} else if (ispax_scantar(tb)) {
+	if (!size) {
+		tb->state=HEADER_STATE_TARVARS_BITROT;
+		tb->header.bytesleft=512;
+	} else {
+		tb->state=PAX_STATE_TARVARS_BITROT;
+		tb->pax.inputbytesleft=((size-1)|511)+1;
+		tb->pax.databytesleft=size;
+		tb->pax.isglobal=(*tb->header.fields.f_typeflag=='g');
+		tb->pax.phase=LENGTH_PHASE_PAX_TARVARS;
+		tb->pax.recordleft=0;
+		tb->pax.digits=0;
+	}
 } else if (islonglink_scantar(tb)) {
 	tb->header.parsed.filetype=LONGLINK_FILETYPE_TARVARS_BITROT;
 	if (strcmp((char *)tb->header.fields.f_name,"././@LongLink")) {
@@ -1120,6 +4549,25 @@ if (isworthy) {
 	tb->slurp.databytesleft=size;
 	tb->slurp.cursor=(unsigned char *)tb->filename;
 	tb->filename[size]='\0';
+} else if (islonglinkname_scantar(tb)) { // used like a pax linkpath
+	if (strcmp((char *)tb->header.fields.f_name,"././@LongLink")) {
+		fprintf(stderr,"%s:%d Tar type K without recognized ././@LongLink\n",__FILE__,__LINE__);
+		GOTOERROR;
+	}
+	if (!size) {
+		fprintf(stderr,"%s:%d Tar type K without size\n",__FILE__,__LINE__);
+		GOTOERROR;
+	}
+	if (size>MAX_FILENAME_TARVARS_BITROT) {
+		fprintf(stderr,"%s:%d Tar type K size is too large: %"PRIu64"\n",__FILE__,__LINE__,size);
+		GOTOERROR;
+	}
+	tb->state=SLURP_STATE_TARVARS_BITROT;
+	tb->slurp.inputbytesleft=((size-1)|511)+1;
+	tb->slurp.databytesleft=size;
+	tb->slurp.cursor=(unsigned char *)tb->pax.linkpath;
+	tb->pax.linkpath[size]='\0';
+	tb->pax.haslinkpath=1;
 } else {
 	tb->header.parsed.filetype=NONE_FILETYPE_TARVARS_BITROT; // need to clear a previous LongLink record
 	if (b->options.isprogress) {
@@ -1182,6 +4630,185 @@ tb->state=HEADER_STATE_TARVARS_BITROT;
 tb->header.bytesleft=512;
 }
 
+static int getkey_pax(struct tarvars_bitrot *tb) {
+char *key=tb->pax.keybuff;
+unsigned int keylen=tb->pax.keylen;
+if (keylen>sizeof(tb->pax.keybuff)) return NONE_KEY_PAX_TARVARS;
+#define ISKEY(a) ((keylen==sizeof(a)-1) && !memcmp(key,a,keylen))
+if (ISKEY("mtime")) return MTIME_KEY_PAX_TARVARS;
+if (tb->pax.isglobal) return NONE_KEY_PAX_TARVARS; // a global path or size makes no sense
+if (ISKEY("path")) return PATH_KEY_PAX_TARVARS;
+if (ISKEY("linkpath")) return LINKPATH_KEY_PAX_TARVARS;
+if (ISKEY("size")) return SIZE_KEY_PAX_TARVARS;
+#undef ISKEY
+return NONE_KEY_PAX_TARVARS;
+}
+
+static int getnumber_pax(uint64_t *u64_out, struct tarvars_bitrot *tb) {
+// decimal, anything after a '.' is dropped and negative times are 0
+uint64_t u64=0;
+unsigned int i;
+if (tb->pax.valuelen && (tb->pax.valuebuff[0]=='-')) {
+	*u64_out=0;
+	return 0;
+}
+for (i=0;i<tb->pax.valuelen;i++) {
+	unsigned char c=tb->pax.valuebuff[i];
+	if (c=='.') break;
+	if ((c<'0') || (c>'9')) GOTOERROR;
+	u64=u64*10+(c-'0');
+}
+*u64_out=u64;
+return 0;
+error:
+	return -1;
+}
+
+static int value_pax(struct tarvars_bitrot *tb, unsigned char *bytes, unsigned int len) {
+char *dest;
+unsigned int max;
+switch (tb->pax.key) {
+	case PATH_KEY_PAX_TARVARS: dest=tb->filename; max=MAX_FILENAME_TARVARS_BITROT; break;
+	case LINKPATH_KEY_PAX_TARVARS: dest=tb->pax.linkpath; max=MAX_FILENAME_TARVARS_BITROT; break;
+	case SIZE_KEY_PAX_TARVARS: case MTIME_KEY_PAX_TARVARS: dest=tb->pax.valuebuff; max=sizeof(tb->pax.valuebuff); break;
+	default: return 0; // skipping, e.g. xattrs
+}
+if (tb->pax.valuelen+len>max) {
+	fprintf(stderr,"%s:%d pax value for %.*s is too long\n",__FILE__,__LINE__,(int)tb->pax.keylen,tb->pax.keybuff);
+	GOTOERROR;
+}
+memcpy(dest+tb->pax.valuelen,bytes,len);
+tb->pax.valuelen+=len;
+return 0;
+error:
+	return -1;
+}
+
+static int endrecord_pax(struct tarvars_bitrot *tb) {
+// an empty value removes the keyword
+switch (tb->pax.key) {
+	case PATH_KEY_PAX_TARVARS:
+		tb->filename[tb->pax.valuelen]='\0';
+		tb->pax.haspath=(tb->pax.valuelen!=0);
+		break;
+	case LINKPATH_KEY_PAX_TARVARS:
+		tb->pax.linkpath[tb->pax.valuelen]='\0';
+		tb->pax.haslinkpath=(tb->pax.valuelen!=0);
+		break;
+	case SIZE_KEY_PAX_TARVARS:
+		if (getnumber_pax(&tb->pax.size,tb)) GOTOERROR;
+		tb->pax.hassize=(tb->pax.valuelen!=0);
+		break;
+	case MTIME_KEY_PAX_TARVARS:
+		if (tb->pax.isglobal) {
+			if (getnumber_pax(&tb->pax.global.mtime,tb)) GOTOERROR;
+			tb->pax.global.hasmtime=(tb->pax.valuelen!=0);
+		} else {
+			if (getnumber_pax(&tb->pax.mtime,tb)) GOTOERROR;
+			tb->pax.hasmtime=(tb->pax.valuelen!=0);
+		}
+		break;
+}
+return 0;
+error:
+	return -1;
+}
+
+static int records_pax(struct tarvars_bitrot *tb, unsigned char *bytes, unsigned int len) {
+// records are "length key=value\n", length counts the whole record, they can be split across reads
+while (len) {
+	unsigned char c;
+	switch (tb->pax.phase) {
+		case LENGTH_PHASE_PAX_TARVARS:
+			c=*bytes;
+			bytes++;
+			len--;
+			if (c==' ') {
+				if (!tb->pax.digits || (tb->pax.recordleft<=tb->pax.digits+1)) GOTOERROR;
+				tb->pax.recordleft-=tb->pax.digits+1;
+				tb->pax.keylen=0;
+				tb->pax.phase=KEY_PHASE_PAX_TARVARS;
+			} else {
+				if ((c<'0') || (c>'9') || (tb->pax.digits==18)) GOTOERROR;
+				tb->pax.recordleft=tb->pax.recordleft*10+(c-'0');
+				tb->pax.digits+=1;
+			}
+			break;
+		case KEY_PHASE_PAX_TARVARS:
+			c=*bytes;
+			bytes++;
+			len--;
+			tb->pax.recordleft-=1;
+			if (!tb->pax.recordleft) GOTOERROR; // no room for the '\n'
+			if (c=='=') {
+				tb->pax.key=getkey_pax(tb);
+				tb->pax.valuelen=0;
+				tb->pax.phase=VALUE_PHASE_PAX_TARVARS;
+			} else {
+				if (tb->pax.keylen<sizeof(tb->pax.keybuff)) tb->pax.keybuff[tb->pax.keylen]=c;
+				tb->pax.keylen+=1;
+			}
+			break;
+		case VALUE_PHASE_PAX_TARVARS:
+			if (tb->pax.recordleft==1) {
+				if (*bytes!='\n') GOTOERROR;
+				bytes++;
+				len--;
+				if (endrecord_pax(tb)) GOTOERROR;
+				tb->pax.recordleft=0;
+				tb->pax.digits=0;
+				tb->pax.phase=LENGTH_PHASE_PAX_TARVARS;
+			} else {
+				unsigned int k;
+				k=len;
+				if (k>tb->pax.recordleft-1) k=tb->pax.recordleft-1;
+				if (value_pax(tb,bytes,k)) GOTOERROR;
+				bytes+=k;
+				len-=k;
+				tb->pax.recordleft-=k;
+			}
+			break;
+	}
+}
+return 0;
+error:
+	return -1;
+}
+
+static int pax_scantar(unsigned int *consumed_out,
+		struct bitrot *b, struct tarvars_bitrot *tb, unsigned char *bytes, unsigned int len) {
+unsigned int consumed;
+uint64_t dbl,ibl;
+dbl=tb->pax.databytesleft;
+ibl=tb->pax.inputbytesleft;
+if (dbl) {
+	consumed=len;
+	if (consumed>dbl) consumed=dbl;
+	if (records_pax(tb,bytes,consumed)) {
+		fprintf(stderr,"%s:%d Error parsing pax records at tar offset %"PRIu64"\n",__FILE__,__LINE__,tb->header.offset);
+		GOTOERROR;
+	}
+	tb->pax.databytesleft=dbl-consumed;
+	if (!tb->pax.databytesleft && (tb->pax.phase!=LENGTH_PHASE_PAX_TARVARS || tb->pax.digits)) {
+		fprintf(stderr,"%s:%d Tar pax header ends inside a record at tar offset %"PRIu64"\n",__FILE__,__LINE__,tb->header.offset);
+		GOTOERROR;
+	}
+} else {
+	consumed=len;
+	if (consumed>ibl) consumed=ibl;
+}
+tb->pax.inputbytesleft=ibl-consumed;
+if (!tb->pax.inputbytesleft) {
+	b->stats.bytesprocessed+=tb->header.parsed.size;
+	tb->state=HEADER_STATE_TARVARS_BITROT;
+	tb->header.bytesleft=512;
+}
+*consumed_out=consumed;
+return 0;
+error:
+	return -1;
+}
+
 static int checksum_scantar(unsigned int *consumed_out,
 		struct bitrot *b, struct tarvars_bitrot *tb, unsigned char *bytes, unsigned int len) {
 unsigned int consumed;
@@ -1189,20 +4816,21 @@ uint64_t dbl;
 dbl=tb->checksum.databytesleft;
 if (dbl) {
 	if (dbl<=len) {
+		if (tb->pool) {
+			if (addslice_pool(tb->pool,bytes,dbl)) GOTOERROR;
+			if (close_pool(tb->pool)) GOTOERROR;
+		} else {
 #ifdef OPENSSL
-		if (1!=MD5_Update(&tb->checksum.ctx,bytes,dbl)) GOTOERROR;
-#elif GNUTLS
-		(void)MD5_Update(&tb->checksum.ctx,bytes,dbl);
-#else
-		(void)addbytes_context_md5(&tb->checksum.ctx,bytes,dbl);
-#endif
-#ifdef OPENSSL
-		if (1!=MD5_Final(tb->checksum.md5,&tb->checksum.ctx)) GOTOERROR;
+			if (1!=MD5_Update(&tb->checksum.ctx,bytes,dbl)) GOTOERROR;
+			if (1!=MD5_Final(tb->checksum.md5,&tb->checksum.ctx)) GOTOERROR;
 #elif GNUTLS
-		(void)MD5_Final(tb->checksum.md5,&tb->checksum.ctx);
+			(void)MD5_Update(&tb->checksum.ctx,bytes,dbl);
+			(void)MD5_Final(tb->checksum.md5,&tb->checksum.ctx);
 #else
-		(void)finish_context_md5(tb->checksum.md5,&tb->checksum.ctx);
+			(void)addbytes_context_md5(&tb->checksum.ctx,bytes,dbl);
+			(void)finish_context_md5(tb->checksum.md5,&tb->checksum.ctx);
 #endif
+		}
 		tb->checksum.databytesleft=0;
 		tb->checksum.inputbytesleft-=dbl;
 		if (!tb->checksum.inputbytesleft) {
@@ -1210,13 +4838,17 @@ if (dbl) {
 		}
 		consumed=dbl;
 	} else {
+		if (tb->pool) {
+			if (addslice_pool(tb->pool,bytes,len)) GOTOERROR;
+		} else {
 #ifdef OPENSSL
-		if (1!=MD5_Update(&tb->checksum.ctx,bytes,len)) GOTOERROR;
+			if (1!=MD5_Update(&tb->checksum.ctx,bytes,len)) GOTOERROR;
 #elif GNUTLS
-		(void)MD5_Update(&tb->checksum.ctx,bytes,len);
+			(void)MD5_Update(&tb->checksum.ctx,bytes,len);
 #else
-		(void)addbytes_context_md5(&tb->checksum.ctx,bytes,len);
+			(void)addbytes_context_md5(&tb->checksum.ctx,bytes,len);
 #endif
+		}
 		tb->checksum.databytesleft=dbl-len;
 		tb->checksum.inputbytesleft-=len;
 		consumed=len;
@@ -1234,55 +4866,36 @@ if (dbl) {
 }
 *consumed_out=consumed;
 return 0;
+error:
+	return -1;
 }
 
-static int endfile_scantar(struct bitrot *b, struct tarvars_bitrot *tb, unsigned char *bytes, unsigned int len) {
-char *fullpath;
+static int finishfile_scantar(struct bitrot *b, char *fullpath, uint64_t mtime, unsigned char *md5) {
+// compares or adds a member once its md5 is known, fullpath is edited and changed back
 struct file_bitrot *file;
 struct dir_bitrot *dir;
 char *filename;
 FILE *msgout;
 
 msgout=b->options.msgout;
-fullpath=tb->filename;
-
-tb->state=HEADER_STATE_TARVARS_BITROT;
-tb->header.bytesleft=512;
-
-b->stats.bytesprocessed+=tb->header.parsed.size;
 
 #if 0
 fprintf(stderr,"%s:%d",__FILE__,__LINE__);
 fputs(" fullpath: ",stderr);
 fputs(fullpath,stderr);
-fprintf(stderr," size: %llu",tb->header.parsed.size);
-fprintf(stderr," mtime: %llu",tb->header.parsed.mtime);
-fprintf(stderr," typeflag: %u",*tb->header.fields.f_typeflag);
+fprintf(stderr," mtime: %llu",mtime);
 fputs("\n",stderr);
 #endif
 
-dir=&b->topdir;
-filename=fullpath;
-while (1) {
-	char *slash;
-	slash=strchr(filename,'/');
-	if (!slash) break;
-	*slash=0;
-	if (!strcmp(filename,".")) {
-	} else {
-		if (findoradd_dir(&dir,b,dir,filename,ISFOUND_FLAG_BITROT)) GOTOERROR;
-	}
-	*slash='/';
-	filename=slash+1;
-}
+if (resolve_cursor(&dir,&filename,&b->cursors.tar,&b->blockmem,&b->topdir,fullpath,ISFOUND_FLAG_BITROT,1)) GOTOERROR;
 
 file=filename_find2_filebyname(dir->files.topnode,filename);
 if (file) {
 	file->flags|=ISFOUND_FLAG_BITROT;
-	if (memcmp(tb->checksum.md5,file->md5,LEN_MD5_BITROT)) {
+	if (memcmp(md5,file->md5,LEN_MD5_BITROT)) {
 		int issave=0;
 		file->flags|=ISMISMATCH_FLAG_BITROT;
-		if (tb->header.parsed.mtime >=b->sumfile.mtime) { // if the mtime is updated, the file changing is not odd
+		if (mtime >=b->sumfile.mtime) { // if the mtime is updated, the file changing is not odd
 			issave=1;
 			if (b->options.isverbose) {
 				(void)unprintprogress(b);
@@ -1304,8 +4917,11 @@ if (file) {
 			}
 		}
 		if (issave) {
-			memcpy(file->md5,tb->checksum.md5,LEN_MD5_BITROT);
+			memcpy(file->md5,md5,LEN_MD5_BITROT);
+			file->flags|=ISCHANGED_FLAG_BITROT;
 			b->stats.changecount+=1;
+		} else { // later hardlinks to this member need what was read, not the catalog
+			if (setkey(&b->hardlinks.mismatches,&b->blockmem,(uint64_t)(uintptr_t)file,0,md5)) GOTOERROR;
 		}
 	} else {
 		file->flags|=ISMATCHED_FLAG_BITROT;
@@ -1320,8 +4936,8 @@ if (file) {
 	if (!(file=ALLOC_blockmem(&b->blockmem,struct file_bitrot))) GOTOERROR;
 	clear_file_bitrot(file);
 	if (!(file->name=strdup_blockmem(&b->blockmem,filename))) GOTOERROR;
-	file->flags=ISFOUND_FLAG_BITROT;
-	memcpy(file->md5,tb->checksum.md5,LEN_MD5_BITROT);
+	file->flags=ISFOUND_FLAG_BITROT|ISCHANGED_FLAG_BITROT;
+	memcpy(file->md5,md5,LEN_MD5_BITROT);
 	(void)addnode2_filebyname(&dir->files.topnode,file);
 	b->stats.changecount+=1;
 	if (b->options.isverbose) {
@@ -1337,6 +4953,22 @@ error:
 	return -1;
 }
 
+static int endfile_scantar(struct bitrot *b, struct tarvars_bitrot *tb, unsigned char *bytes, unsigned int len) {
+tb->state=HEADER_STATE_TARVARS_BITROT;
+tb->header.bytesleft=512;
+
+b->stats.bytesprocessed+=tb->header.parsed.size;
+
+if (tb->pool) return 0; // it was queued by consider_scantar, reconcile_pool finishes it
+if (finishfile_scantar(b,tb->filename,tb->header.parsed.mtime,tb->checksum.md5)) GOTOERROR;
+if (b->tarindex.fout && !tb->header.parsed.ishardlink) {
+	if (addindex_scantar(b,tb->filename,tb->header.offset,tb->header.parsed.size,tb->checksum.md5)) GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
+
 static int skipping_scantar(unsigned int *consumed_out,
 		struct bitrot *b, struct tarvars_bitrot *tb, unsigned char *bytes, unsigned int len) {
 uint64_t ibl;
@@ -1358,10 +4990,14 @@ static int endblocks_scantar(unsigned int *consumed_out,
 unsigned int bytesleft;
 bytesleft=tb->endblocks.bytesleft;
 if (bytesleft>len) {
-	memcpy(tb->header.bytes+512-bytesleft,bytes,bytesleft);
+	memcpy(tb->header.bytes+512-bytesleft,bytes,len);
 	tb->endblocks.bytesleft=bytesleft-len;
 	*consumed_out=len;
-} else if (bytesleft<=len) {
+} else if (bytesleft==512) { // the whole block is in bytes
+	if (!is512zeros(bytes)) GOTOERROR;
+	tb->state=FINISHED_STATE_TARVARS_BITROT;
+	*consumed_out=bytesleft;
+} else {
 	memcpy(tb->header.bytes+512-bytesleft,bytes,bytesleft);
 	if (!is512zeros(tb->header.bytes)) GOTOERROR;
 	tb->state=FINISHED_STATE_TARVARS_BITROT;
@@ -1378,6 +5014,9 @@ while (len) {
 	switch (tb->state) {
 		case HEADER_STATE_TARVARS_BITROT:
 			if (header_scantar(&consumed,b,tb,bytes,len)) GOTOERROR;
+			if (tb->state==CONSIDER_STATE_TARVARS_BITROT) { // the fields could point into bytes
+				if (consider_scantar(b,tb,bytes,len)) GOTOERROR;
+			}
 			break;
 		case CONSIDER_STATE_TARVARS_BITROT:
 			if (consider_scantar(b,tb,bytes,len)) GOTOERROR;
@@ -1388,6 +5027,9 @@ while (len) {
 		case ENDSLURP_STATE_TARVARS_BITROT:
 			(void)endslurp_scantar(b,tb,bytes,len);
 			continue;
+		case PAX_STATE_TARVARS_BITROT:
+			if (pax_scantar(&consumed,b,tb,bytes,len)) GOTOERROR;
+			break;
 		case CHECKSUM_STATE_TARVARS_BITROT:
 			if (checksum_scantar(&consumed,b,tb,bytes,len)) GOTOERROR;
 			break;
@@ -1406,6 +5048,7 @@ while (len) {
 #if 1
 	if (!consumed) GOTOERROR;
 #endif
+	tb->offset+=consumed;
 	bytes+=consumed;
 	len-=consumed;
 }
@@ -1413,3 +5056,705 @@ return 0;
 error:
 	return -1;
 }
+
+#ifdef LINUX
+static ssize_t teeread_ring(struct ring_tar *r, unsigned char *chunk, unsigned int max) {
+// tee() copies pipe pages to fdout inside the kernel, then we read the same bytes to hash them
+ssize_t n,k,num=0;
+while (1) {
+	n=tee(r->fdin,r->fdout,max,0);
+	if (n>=0) break;
+	if (errno==EINTR) continue;
+	if ((errno==EINVAL) && !r->isteed) { // e.g. the same pipe on both ends, fall back
+		r->istee=0;
+		return read(r->fdin,chunk,max);
+	}
+	return -1;
+}
+r->isteed=1;
+while (num<n) {
+	k=read(r->fdin,chunk+num,n-num);
+	if (k<=0) {
+		if (k && (errno==EINTR)) continue;
+		errno=EIO; // tee said the bytes were there
+		return -1;
+	}
+	num+=k;
+}
+return n;
+}
+#endif
+
+static ssize_t rawread_ring(struct ring_tar *r, unsigned char *dest, unsigned int max) {
+// reads up to max from fdin and relays it, as it was, to fdout
+ssize_t k;
+#ifdef LINUX
+if (r->istee) {
+	k=teeread_ring(r,dest,max);
+	if (k<0) fprintf(stderr,"%s:%d error relaying tar data (%s)\n",__FILE__,__LINE__,strerror(errno));
+} else
+#endif
+{
+	do {
+		k=read(r->fdin,dest,max);
+	} while ((k<0) && (errno==EINTR));
+	if (k<0) fprintf(stderr,"%s:%d error reading tar data (%s)\n",__FILE__,__LINE__,strerror(errno));
+}
+if ((k>0) && (r->fdout>=0) && !r->istee) {
+	if (writen_bitrot(r->fdout,dest,k)) {
+		fprintf(stderr,"%s:%d error relaying tar data (%s)\n",__FILE__,__LINE__,strerror(errno));
+		k=-1;
+	}
+}
+return k;
+}
+
+static ssize_t inflate_ring(struct ring_tar *r, unsigned char *chunk) {
+// fills chunk with decompressed tar data, 0 at the end
+struct inflate_ring *z=&r->inflate;
+unsigned char *out=chunk;
+unsigned int outleft=READCHUNK_BITROT;
+while (outleft) {
+	if (!z->inleft && !z->ispending) {
+		ssize_t k;
+		if (z->isinputeof) break;
+		k=rawread_ring(r,z->input,READCHUNK_BITROT);
+		if (k<0) return -1;
+		if (!k) {
+			z->isinputeof=1;
+			if (!z->isend) {
+				fprintf(stderr,"%s:%d compressed tar data is short\n",__FILE__,__LINE__);
+				return -1;
+			}
+			break;
+		}
+		z->in=z->input;
+		z->inleft=k;
+	}
+	if (z->isgarbage) { // it's still read, to be relayed
+		z->inleft=0;
+		continue;
+	}
+	if (z->isend) {
+		if (nextframe_inflate(z)) return -1;
+		if (z->isend) {
+			z->ispending=0;
+			continue;
+		}
+	}
+	if (step_inflate(z,&out,&outleft)) return -1;
+	z->ispending=!outleft;
+}
+return READCHUNK_BITROT-outleft;
+}
+
+static ssize_t read_ring(struct ring_tar *r, unsigned char *chunk) {
+// the first read decides if the data needs to be decompressed
+ssize_t k;
+int format;
+if (r->inflate.format) return inflate_ring(r,chunk);
+k=rawread_ring(r,chunk,READCHUNK_BITROT);
+if ((k<=0) || r->ischecked) return k;
+r->ischecked=1;
+while (k<MAGICLEN_INFLATE) { // a pipe can return fewer bytes than the longest magic
+	ssize_t n;
+	n=rawread_ring(r,chunk+k,READCHUNK_BITROT-k);
+	if (n<0) return -1;
+	if (!n) break;
+	k+=n;
+}
+format=getformat_inflate(chunk,k);
+if (!format) return k;
+if (init_inflate(&r->inflate,format)) return -1;
+memcpy(r->inflate.input,chunk,k);
+r->inflate.in=r->inflate.input;
+r->inflate.inleft=k;
+return inflate_ring(r,chunk);
+}
+
+static void *reader_ring(void *arg) {
+// reads and relays at pipe speed, only waits when the scanner is a whole ring behind
+struct ring_tar *r=arg;
+while (1) {
+	unsigned char *chunk;
+	ssize_t k;
+	(ignore)pthread_mutex_lock(&r->mutex);
+	while ((r->head-r->freetail==r->slots) && !r->isquit) (ignore)pthread_cond_wait(&r->cond,&r->mutex);
+	if (r->isquit) {
+		(ignore)pthread_mutex_unlock(&r->mutex);
+		break;
+	}
+	chunk=r->buffer+(r->head%r->slots)*READCHUNK_BITROT;
+	(ignore)pthread_mutex_unlock(&r->mutex);
+
+	k=read_ring(r,chunk);
+
+	(ignore)pthread_mutex_lock(&r->mutex);
+	if (k>0) {
+		r->lens[r->head%r->slots]=k;
+		r->head+=1;
+	} else if (!k) {
+		r->iseof=1;
+	} else {
+		r->iserror=1;
+	}
+	(ignore)pthread_cond_broadcast(&r->cond);
+	(ignore)pthread_mutex_unlock(&r->mutex);
+	if (k<=0) break;
+}
+return NULL;
+}
+
+static int ringtar_bitrot(struct bitrot *b, struct tarvars_bitrot *tb, int fdin, int fdout) {
+// scans tar data from fdin, relaying it to fdout if fdout>=0
+struct ring_tar r;
+pthread_t tid;
+int isinit=0,isthread=0;
+
+memset(&r,0,sizeof(r));
+r.slots=SLOTS_RING_BITROT;
+if (b->options.threads>1) { // hashed chunks are held until every worker is done with them
+	r.slots*=b->options.threads;
+	if (r.slots>PREFETCHBYTES_BITROT/READCHUNK_BITROT) r.slots=PREFETCHBYTES_BITROT/READCHUNK_BITROT;
+}
+r.fdin=fdin;
+r.fdout=fdout;
+r.inflate.threads=b->options.threads;
+#ifdef LINUX
+if (fdout>=0) {
+	struct stat st1,st2;
+	if (!fstat(fdin,&st1) && !fstat(fdout,&st2) && S_ISFIFO(st1.st_mode) && S_ISFIFO(st2.st_mode)) r.istee=1;
+}
+#endif
+if (!(r.buffer=malloc(r.slots*READCHUNK_BITROT))) GOTOERROR;
+if (!(r.lens=malloc(r.slots*sizeof(unsigned int)))) GOTOERROR;
+if (!(r.refs=calloc(r.slots,sizeof(unsigned int)))) GOTOERROR;
+if (pthread_mutex_init(&r.mutex,NULL)) GOTOERROR;
+if (pthread_cond_init(&r.cond,NULL)) {
+	(ignore)pthread_mutex_destroy(&r.mutex);
+	GOTOERROR;
+}
+isinit=1;
+if (pthread_create(&tid,NULL,reader_ring,&r)) GOTOERROR;
+isthread=1;
+if (b->options.threads>1) { // the scanner queues file data, workers hash it
+	if (startworkers_pool(&r,b->options.threads)) GOTOERROR;
+	tb->pool=&r;
+}
+
+while (1) {
+	unsigned char *chunk;
+	unsigned int len;
+	(ignore)pthread_mutex_lock(&r.mutex);
+	while ((r.head==r.tail) && !r.iseof && !r.iserror) (ignore)pthread_cond_wait(&r.cond,&r.mutex);
+	if (r.head==r.tail) {
+		(ignore)pthread_mutex_unlock(&r.mutex);
+		break;
+	}
+	chunk=r.buffer+(r.tail%r.slots)*READCHUNK_BITROT;
+	len=r.lens[r.tail%r.slots];
+	(ignore)pthread_mutex_unlock(&r.mutex);
+	r.pool.slot=r.tail;
+
+	if (scantar_bitrot(b,tb,chunk,len)) GOTOERROR;
+	if (b->options.readusleep) {
+		usleep(b->options.readusleep);
+	}
+
+	(ignore)pthread_mutex_lock(&r.mutex);
+	r.tail+=1;
+	(void)freetail_ring(&r);
+	(ignore)pthread_cond_broadcast(&r.cond);
+	(ignore)pthread_mutex_unlock(&r.mutex);
+	if (tb->pool) {
+		if (reconcile_pool(b,&r,0)) GOTOERROR;
+	}
+}
+(ignore)pthread_join(tid,NULL);
+isthread=0;
+if (r.iserror) GOTOERROR;
+if (tb->pool) {
+	if (reconcile_pool(b,&r,1)) GOTOERROR;
+}
+tb->pool=NULL;
+(void)stopworkers_pool(&r);
+(void)deinit_pool(&r);
+(void)deinit_inflate(&r.inflate);
+(ignore)pthread_cond_destroy(&r.cond);
+(ignore)pthread_mutex_destroy(&r.mutex);
+free(r.refs);
+free(r.lens);
+free(r.buffer);
+return 0;
+error:
+	tb->pool=NULL;
+	if (isinit) { // the reader stops after its current read
+		(void)stopworkers_pool(&r);
+		if (isthread) (ignore)pthread_join(tid,NULL);
+	}
+	(void)deinit_pool(&r);
+	(void)deinit_inflate(&r.inflate);
+	if (isinit) {
+		(ignore)pthread_cond_destroy(&r.cond);
+		(ignore)pthread_mutex_destroy(&r.mutex);
+	}
+	iffree(r.refs);
+	iffree(r.lens);
+	iffree(r.buffer);
+	return -1;
+}
+
+static uint64_t skipahead_scantar(struct bitrot *b, struct tarvars_bitrot *tb) {
+// finishes skipping a member without its data, returns how many bytes the caller should jump
+uint64_t ibl;
+if (tb->state!=SKIPPING_STATE_TARVARS_BITROT) return 0;
+ibl=tb->checksum.inputbytesleft;
+b->stats.bytesprocessed+=tb->header.parsed.size;
+tb->state=HEADER_STATE_TARVARS_BITROT;
+tb->header.bytesleft=512;
+tb->offset+=ibl;
+return ibl;
+}
+
+#ifdef USEMMAP
+static void advise_maptar(unsigned char **advised_inout, unsigned char *ptr, uint64_t len) {
+// asks for pages that will be parsed or hashed, past what's already been asked for
+unsigned char *advised=*advised_inout;
+uintptr_t pagemask;
+if (ptr+len<=advised) return;
+if (ptr<advised) {
+	len-=advised-ptr;
+	ptr=advised;
+}
+*advised_inout=ptr+len;
+pagemask=sysconf(_SC_PAGESIZE)-1;
+len+=(uintptr_t)ptr&pagemask;
+ptr-=(uintptr_t)ptr&pagemask;
+(ignore)madvise(ptr,len,MADV_WILLNEED);
+}
+
+static int maptar_bitrot(int *isnommap_out, struct bitrot *b, struct tarvars_bitrot *tb, int fd, uint64_t offset, uint64_t filesize) {
+// members are hashed straight from the mapping from offset on, skipped members are never touched
+struct mmapwrapper mw;
+struct ring_tar r;
+unsigned char *ptr,*advised;
+uint64_t left;
+int isinit=0;
+
+clear_mmapwrapper(&mw);
+memset(&r,0,sizeof(r));
+
+#if UINTPTR_MAX == 0xffffffff
+if (filesize>0xff000000) { // doesn't fit, read() it instead
+	*isnommap_out=1;
+	return 0;
+}
+#endif
+if (initreadfd2_mmapwrapper(&mw,fd,filesize)) {
+	*isnommap_out=1;
+	return 0;
+}
+
+// readahead would otherwise read the members we skip, advise_maptar asks for the rest
+(ignore)madvise(mw.addr,mw.addrlength,MADV_RANDOM);
+
+r.slots=1; // slices point into the mapping, nothing is reused
+if (!(r.refs=calloc(1,sizeof(unsigned int)))) GOTOERROR;
+if (pthread_mutex_init(&r.mutex,NULL)) GOTOERROR;
+if (pthread_cond_init(&r.cond,NULL)) {
+	(ignore)pthread_mutex_destroy(&r.mutex);
+	GOTOERROR;
+}
+isinit=1;
+if (b->options.threads>1) {
+	if (startworkers_pool(&r,b->options.threads)) GOTOERROR;
+	tb->pool=&r;
+}
+
+ptr=advised=OFFSET_MMAP(&mw,offset);
+left=mw.filesize-offset;
+while (left) {
+	unsigned int len=READCHUNK_BITROT;
+	int isskipping;
+	if ((tb->state==SKIPPING_STATE_TARVARS_BITROT) && (tb->checksum.inputbytesleft<=left)) { // a short archive is still walked to the end
+		uint64_t skip;
+		skip=skipahead_scantar(b,tb);
+		ptr+=skip;
+		left-=skip;
+		continue;
+	}
+	if (left<len) len=left;
+	isskipping=(tb->state==SKIPPING_STATE_TARVARS_BITROT);
+	if (!isskipping) (void)advise_maptar(&advised,ptr,len);
+	if (scantar_bitrot(b,tb,ptr,len)) GOTOERROR;
+	ptr+=len;
+	left-=len;
+	if (tb->state==CHECKSUM_STATE_TARVARS_BITROT) {
+		(void)advise_maptar(&advised,ptr,_BADMIN(_BADMIN(left,tb->checksum.inputbytesleft),PREFETCHBYTES_BITROT));
+	}
+	if (tb->pool) {
+		if (reconcile_pool(b,&r,0)) GOTOERROR;
+	}
+	if (tb->state==FINISHED_STATE_TARVARS_BITROT) break;
+	if (b->options.readusleep && !isskipping) { // windows of a skipped member aren't read
+		usleep(b->options.readusleep);
+	}
+}
+if (tb->pool) {
+	if (reconcile_pool(b,&r,1)) GOTOERROR;
+}
+
+tb->pool=NULL;
+(void)stopworkers_pool(&r);
+(void)deinit_pool(&r);
+(ignore)pthread_cond_destroy(&r.cond);
+(ignore)pthread_mutex_destroy(&r.mutex);
+free(r.refs);
+deinit_mmapwrapper(&mw);
+*isnommap_out=0;
+return 0;
+error:
+	tb->pool=NULL;
+	if (isinit) {
+		(void)stopworkers_pool(&r);
+		(void)deinit_pool(&r);
+		(ignore)pthread_cond_destroy(&r.cond);
+		(ignore)pthread_mutex_destroy(&r.mutex);
+	}
+	iffree(r.refs);
+	deinit_mmapwrapper(&mw);
+	return -1;
+}
+#endif
+
+static int seektar_bitrot(struct bitrot *b, struct tarvars_bitrot *tb, int fd, uint64_t offset, uint64_t filesize) {
+// for regular files that can't be mapped, skipped members are lseek()ed over
+unsigned char *buffer=NULL;
+
+if (!(buffer=malloc(READCHUNK_BITROT))) GOTOERROR;
+while (1) {
+	ssize_t k;
+	uint64_t skip;
+	k=read(fd,buffer,READCHUNK_BITROT);
+	if (k<0) {
+		if (errno==EINTR) continue;
+		fprintf(stderr,"%s:%d error reading tar data (%s)\n",__FILE__,__LINE__,strerror(errno));
+		GOTOERROR;
+	}
+	if (!k) break;
+	offset+=k;
+	if (scantar_bitrot(b,tb,buffer,k)) GOTOERROR;
+	if (tb->state==FINISHED_STATE_TARVARS_BITROT) break;
+	if ((tb->state==SKIPPING_STATE_TARVARS_BITROT) && (tb->checksum.inputbytesleft<=filesize-offset)) { // a short archive is still read to the end
+		skip=skipahead_scantar(b,tb);
+		if (0>lseek(fd,skip,SEEK_CUR)) GOTOERROR;
+		offset+=skip;
+	}
+	if (b->options.readusleep) {
+		usleep(b->options.readusleep);
+	}
+}
+free(buffer);
+return 0;
+error:
+	iffree(buffer);
+	return -1;
+}
+
+int readtar_bitrot(struct bitrot *b, struct tarvars_bitrot *tb, int fdin, int fdout) {
+// scans tar data from fdin, relaying it to fdout if fdout>=0, regular files are scanned without reading skipped members
+struct stat st;
+off_t offset;
+int isnommap=1;
+
+if ((fdout>=0) || fstat(fdin,&st) || !S_ISREG(st.st_mode)) return ringtar_bitrot(b,tb,fdin,fdout);
+offset=lseek(fdin,0,SEEK_CUR); // stdin might not be at the start
+if ((offset<0) || (offset>st.st_size)) return ringtar_bitrot(b,tb,fdin,fdout);
+{
+	unsigned char magic[8];
+	ssize_t k;
+	k=pread(fdin,magic,sizeof(magic),offset);
+	if ((k>0) && getformat_inflate(magic,k)) return ringtar_bitrot(b,tb,fdin,fdout); // the reader decompresses it
+}
+#ifdef USEMMAP
+if (offset<st.st_size) {
+	if (maptar_bitrot(&isnommap,b,tb,fdin,offset,st.st_size)) GOTOERROR;
+}
+#endif
+if (isnommap) {
+	if (seektar_bitrot(b,tb,fdin,offset,st.st_size)) GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
+
+int readtarfile_bitrot(struct bitrot *b, struct tarvars_bitrot *tb, char *filename) {
+// scans a tar file on disk, mapped if possible
+struct stat st;
+int fd=-1;
+
+fd=open(filename,O_RDONLY);
+if (fd<0) {
+	fprintf(stderr,"%s:%d error opening %s (%s)\n",__FILE__,__LINE__,filename,strerror(errno));
+	GOTOERROR;
+}
+if (fstat(fd,&st)) GOTOERROR;
+if (!S_ISREG(st.st_mode)) {
+	fprintf(stderr,"%s:%d %s isn't a regular file\n",__FILE__,__LINE__,filename);
+	GOTOERROR;
+}
+if (readtar_bitrot(b,tb,fd,-1)) GOTOERROR;
+(ignore)close(fd);
+return 0;
+error:
+	ifclose(fd);
+	return -1;
+}
+
+int openindex_bitrot(struct bitrot *b, char *sumfile) {
+// --index, members are written to sumfile.index.tmp and it's renamed when the scan is done
+unsigned int n;
+n=strlen(sumfile);
+if (!(b->tarindex.name=alloc_blockmem(&b->blockmem,n+7))) GOTOERROR;
+sprintf(b->tarindex.name,"%s.index",sumfile);
+if (!(b->tarindex.tempname=alloc_blockmem(&b->blockmem,n+11))) GOTOERROR;
+sprintf(b->tarindex.tempname,"%s.index.tmp",sumfile);
+if (!(b->tarindex.fout=fopen(b->tarindex.tempname,"w"))) {
+	fprintf(stderr,"%s:%d error opening %s (%s)\n",__FILE__,__LINE__,b->tarindex.tempname,strerror(errno));
+	GOTOERROR;
+}
+if (0>fputs(HEADER_INDEX_BITROT,b->tarindex.fout)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+int closeindex_bitrot(struct bitrot *b) {
+FILE *fout=b->tarindex.fout;
+b->tarindex.fout=NULL;
+if (fclose(fout)) {
+	fprintf(stderr,"%s:%d error writing %s (%s)\n",__FILE__,__LINE__,b->tarindex.tempname,strerror(errno));
+	GOTOERROR;
+}
+if (rename(b->tarindex.tempname,b->tarindex.name)) {
+	fprintf(stderr,"%s:%d error renaming %s (%s)\n",__FILE__,__LINE__,b->tarindex.tempname,strerror(errno));
+	GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
+
+struct entry_members {
+	char *path;
+	uint64_t dataoffset,size;
+	unsigned char md5[LEN_MD5_BITROT]; // from the index
+	unsigned char readmd5[LEN_MD5_BITROT];
+	int isshort; // the archive ends before the member does
+};
+
+struct members_bitrot {
+	struct bitrot *b;
+	int fd;
+	struct entry_members *list;
+	unsigned int count,max;
+};
+
+static char *trimdot_members(char *path) {
+// "./a/b" and "a/b" are the same member, "." is everything
+while ((path[0]=='.') && (path[1]=='/')) path+=2;
+if ((path[0]=='.') && !path[1]) path+=1;
+return path;
+}
+
+static int ismatch_members(char *path, char **members, unsigned int count) {
+// a member matches itself and anything under it
+unsigned int i;
+path=trimdot_members(path);
+for (i=0;i<count;i++) {
+	char *m;
+	unsigned int n;
+	m=trimdot_members(members[i]);
+	n=strlen(m);
+	while (n && (m[n-1]=='/')) n--;
+	if (!n) return 1;
+	if (strncmp(path,m,n)) continue;
+	if (!path[n] || (path[n]=='/')) return 1;
+}
+return 0;
+}
+
+static int hashmember_members(void *arg, unsigned int i) {
+struct members_bitrot *mb=arg;
+struct entry_members *e=&mb->list[i];
+unsigned char *buffer=NULL;
+uint64_t offset,left;
+MD5_CTX ctx;
+
+if (!(buffer=malloc(READCHUNK_BITROT))) GOTOERROR;
+#ifdef OPENSSL
+if (1!=MD5_Init(&ctx)) GOTOERROR;
+#elif GNUTLS
+(void)MD5_Init(&ctx);
+#else
+(void)clear_context_md5(&ctx);
+#endif
+offset=e->dataoffset;
+left=e->size;
+while (left) {
+	ssize_t k;
+	k=pread(mb->fd,buffer,_BADMIN(left,READCHUNK_BITROT),offset);
+	if (k<0) {
+		if (errno==EINTR) continue;
+		fprintf(stderr,"%s:%d error reading %s (%s)\n",__FILE__,__LINE__,e->path,strerror(errno));
+		GOTOERROR;
+	}
+	if (!k) {
+		e->isshort=1;
+		break;
+	}
+#ifdef OPENSSL
+	if (1!=MD5_Update(&ctx,buffer,k)) GOTOERROR;
+#elif GNUTLS
+	(void)MD5_Update(&ctx,buffer,k);
+#else
+	(void)addbytes_context_md5(&ctx,buffer,k);
+#endif
+	offset+=k;
+	left-=k;
+	if (mb->b->options.readusleep) usleep(mb->b->options.readusleep);
+}
+#ifdef OPENSSL
+if (1!=MD5_Final(e->readmd5,&ctx)) GOTOERROR;
+#elif GNUTLS
+(void)MD5_Final(e->readmd5,&ctx);
+#else
+(void)finish_context_md5(e->readmd5,&ctx);
+#endif
+free(buffer);
+return 0;
+error:
+	iffree(buffer);
+	return -1;
+}
+
+static int loadindex_members(struct members_bitrot *mb, char *indexfile, char **members, unsigned int count) {
+// collects the index entries that match members
+FILE *ff=NULL;
+char *oneline=NULL;
+
+if (!(ff=fopen(indexfile,"r"))) {
+	fprintf(stderr,"%s:%d error opening %s (%s)\n",__FILE__,__LINE__,indexfile,strerror(errno));
+	GOTOERROR;
+}
+if (!(oneline=malloc(MAXLINELEN))) GOTOERROR;
+if (!fgets(oneline,MAXLINELEN,ff) || strcmp(oneline,HEADER_INDEX_BITROT)) {
+	fprintf(stderr,"%s:%d %s isn't a bitrotchecker index\n",__FILE__,__LINE__,indexfile);
+	GOTOERROR;
+}
+while (fgets(oneline,MAXLINELEN,ff)) {
+	struct entry_members *e;
+	uint64_t headeroffset,dataoffset,size;
+	char *cursor,*path;
+	unsigned int n;
+	n=strlen(oneline);
+	if (!n || (oneline[n-1]!='\n')) GOTOERROR;
+	oneline[n-1]='\0';
+	if (n<LEN_MD5_BITROT*2+2) GOTOERROR;
+	cursor=oneline+LEN_MD5_BITROT*2+2;
+	headeroffset=strtoull(cursor,&cursor,10);
+	dataoffset=strtoull(cursor,&cursor,10);
+	size=strtoull(cursor,&cursor,10);
+	if ((*cursor!=' ') || (dataoffset!=headeroffset+512)) {
+		fprintf(stderr,"%s:%d bad line in %s\n",__FILE__,__LINE__,indexfile);
+		GOTOERROR;
+	}
+	path=cursor+1;
+	if (!ismatch_members(path,members,count)) continue;
+	if (mb->count==mb->max) {
+		struct entry_members *temp;
+		unsigned int newmax;
+		newmax=mb->max*2+64;
+		if (!(temp=realloc(mb->list,newmax*sizeof(struct entry_members)))) GOTOERROR;
+		mb->list=temp;
+		mb->max=newmax;
+	}
+	e=&mb->list[mb->count];
+	memset(e,0,sizeof(struct entry_members));
+	if (loadhex(e->md5,LEN_MD5_BITROT,oneline)) GOTOERROR;
+	if (!(e->path=strdup_blockmem(&mb->b->blockmem,path))) GOTOERROR;
+	e->dataoffset=dataoffset;
+	e->size=size;
+	mb->count+=1;
+}
+if (ferror(ff)) GOTOERROR;
+free(oneline);
+fclose(ff);
+return 0;
+error:
+	iffree(oneline);
+	iffclose(ff);
+	return -1;
+}
+
+int verifymembers_bitrot(struct bitrot *b, char *sumfile, char *tarfile, char **members, unsigned int count) {
+// --verify-member, preads members listed in sumfile.index from tarfile and checks them against the index
+struct members_bitrot mb;
+FILE *msgout=b->options.msgout;
+char *indexfile=NULL;
+unsigned int i;
+
+memset(&mb,0,sizeof(mb));
+mb.b=b;
+mb.fd=-1;
+if (!(indexfile=malloc(strlen(sumfile)+7))) GOTOERROR;
+sprintf(indexfile,"%s.index",sumfile);
+mb.fd=open(tarfile,O_RDONLY);
+if (mb.fd<0) {
+	fprintf(stderr,"%s:%d error opening %s (%s)\n",__FILE__,__LINE__,tarfile,strerror(errno));
+	GOTOERROR;
+}
+{
+	unsigned char magic[8];
+	ssize_t k;
+	k=pread(mb.fd,magic,sizeof(magic),0);
+	if ((k>0) && getformat_inflate(magic,k)) {
+		fprintf(stderr,"%s:%d --verify-member needs an uncompressed archive, %s is compressed\n",__FILE__,__LINE__,tarfile);
+		GOTOERROR;
+	}
+}
+if (loadindex_members(&mb,indexfile,members,count)) GOTOERROR;
+for (i=0;i<count;i++) {
+	unsigned int j;
+	for (j=0;j<mb.count;j++) {
+		if (ismatch_members(mb.list[j].path,&members[i],1)) break;
+	}
+	if (j==mb.count) {
+		if (0>fprintf(msgout,"member not in index: %s\n",members[i])) GOTOERROR;
+	}
+}
+
+if (runjobs(b->options.threads,mb.count,hashmember_members,&mb)) GOTOERROR;
+for (i=0;i<mb.count;i++) { // in order, so messages don't depend on the threads
+	struct entry_members *e=&mb.list[i];
+	b->stats.bytesprocessed+=e->size;
+	if (e->isshort) {
+		if (0>fprintf(msgout,"archive is short: %s\n",e->path)) GOTOERROR;
+	} else if (memcmp(e->md5,e->readmd5,LEN_MD5_BITROT)) {
+		if (0>fprintf(msgout,"MD5 has changed: %s\n",e->path)) GOTOERROR;
+	} else if (b->options.isverbose) {
+		if (0>fprintf(msgout,"matched: %s\n",e->path)) GOTOERROR;
+	}
+}
+
+(ignore)close(mb.fd);
+iffree(mb.list);
+free(indexfile);
+return 0;
+error:
+	ifclose(mb.fd);
+	iffree(mb.list);
+	iffree(indexfile);
+	return -1;
+}
@@ -23,8 +23,20 @@
 #define ISINFILE_FLAG_BITROT		2
 #define ISMATCHED_FLAG_BITROT	4
 #define ISMISMATCH_FLAG_BITROT	8
+#define ISCHANGED_FLAG_BITROT	16
+#define ISSHARD_FLAG_BITROT		32
 
 #define READCHUNK_BITROT	(128*1024)
+#define WRITECHUNK_BITROT	(1024*1024)
+#define SLOTS_RING_BITROT	16 // READCHUNK_BITROT chunks the tar reader can be ahead of the scanner
+#define DENTSCHUNK_BITROT	(128*1024)
+#define MAXSORT_DENTS_BITROT	(4*1024*1024)
+#define SMALLFILEMAX_BITROT	(64*1024) // default for --small-files, files up to this are read() instead of mmapped
+#define MAX_THREADS_BITROT	256 // --threads is clamped to this
+#define PREFETCHBYTES_BITROT	(64*1024*1024) // most that's been read ahead and not yet hashed
+#define MINSIZE_EXTENTS_BITROT	(64*1024) // smaller files are cheaper to just read
+#define SAMPLE_EXTENTS_BITROT	4096 // first and last blocks are part of the fingerprint
+#define HEADER_INDEX_BITROT	"# bitrotchecker index 1\n"
 
 struct file_bitrot {
 	char *name;
@@ -52,6 +64,32 @@ struct dir_bitrot {
 	} treevars;
 };
 
+#define MAX_PATH_CURSOR_BITROT	2047
+#define MAX_DEPTH_CURSOR_BITROT	255
+struct cursor_bitrot { // the last directory a path resolved to, the next path only walks where it differs
+	struct dir_bitrot *top; // NULL until first use
+	unsigned int depth; // components cached, deeper ones are walked every time
+	unsigned int ends[MAX_DEPTH_CURSOR_BITROT+1]; // ends[i] is the length of the first i components with their '/'
+	struct dir_bitrot *dirs[MAX_DEPTH_CURSOR_BITROT+1]; // dirs[0] is top
+	char path[MAX_PATH_CURSOR_BITROT+1];
+};
+
+struct keyed_bitrot { // md5s by a pair of numbers, e.g. (dev, inode) for hardlinks
+	uint64_t key1,key2;
+	unsigned char md5[LEN_MD5_BITROT];
+	struct {
+		signed char balance;
+		struct keyed_bitrot *left,*right;
+	} treevars;
+};
+
+struct dentsbuffer_bitrot { // directory entries for one level of the scan
+	unsigned char *ptr; // getdents64
+	unsigned int ptrmax;
+	void *entries; // sorted by inode
+	unsigned int entriesmax;
+};
+
 struct bitrot {
 	struct {
 		dev_t xdev;
@@ -61,6 +99,42 @@ struct bitrot {
 		uint64_t mtime; // don't print mismatches if a file mtime is newer than this
 		char *name;
 	} sumfile;
+	struct {
+		char *name; // sumfile.log
+#define MAX_IDENTITY_CHANGELOG_BITROT	79
+		char identity[MAX_IDENTITY_CHANGELOG_BITROT+1]; // first line, to match the log with the sumfile it extends
+		uint64_t basesize; // size of sumfile
+		uint64_t validsize; // complete records, there could be a torn append after this
+		uint64_t size;
+#define COMPACTRATIO_CHANGELOG_BITROT	4
+		int isbase; // sumfile exists
+		int isfound; // changelog exists and matches sumfile
+	} changelog;
+	struct {
+		char *name; // sumfile.index, --index with --tar
+		char *tempname;
+		FILE *fout;
+	} tarindex;
+	struct {
+		char *dirname; // --shards, a manifest and a sumfile per top-level directory
+		unsigned int count;
+		struct blockmem *blockmems; // one per shard, they're loaded in parallel
+		int issubtree; // the manifest lists the shard for --subtree
+	} shards;
+	struct {
+		struct dentsbuffer_bitrot *buffers; // by depth
+		unsigned int count,depth;
+	} dents;
+	struct {
+		struct keyed_bitrot *inodes; // (dev, inode) of files with more than one link, hashed once
+		struct keyed_bitrot *mismatches; // by file_bitrot pointer, the tar md5 when a mismatch wasn't saved
+	} hardlinks;
+	struct {
+		struct keyed_bitrot *dirs; // (dev, inode) of directories entered, so each is scanned once
+	} visited;
+	struct {
+		struct keyed_bitrot *fingerprints; // --shared-extents, md5 of a fully shared extent map
+	} sharedextents;
 	struct {
 		unsigned int ptrmax;
 		unsigned char *ptr;
@@ -80,6 +154,9 @@ struct bitrot {
 		FILE *msgout;
 		uint64_t ceiling_mtime; // don't collect files newer than this
 		unsigned int readusleep;
+		unsigned int smallfilemax; // read() files up to this size in one call, instead of mmap
+		unsigned int prefetchcount; // files to posix_fadvise(WILLNEED) ahead of the one being hashed, 0 is off
+		unsigned int threads;
 		int isonefilesystem;
 		int isprogress;
 		int isverbose;
@@ -87,7 +164,19 @@ struct bitrot {
 		int isnothingnew;
 		int isfollow; // follow symlinks
 		int issavechanges;
+		int ischangelog; // append changes to sumfile.log
+		int iscompact; // rewrite sumfile and remove sumfile.log
+		int isstream; // merge the sorted sumfile with a sorted scan, without loading it
+		char *subtree; // only load, scan and save this directory, relative to the root
+		int iscatalogonly; // walk the loaded tree instead of listing directories
+		int issharedextents; // reuse md5s for files with identical shared extents (reflinks, dedup)
+		int isindex; // write the offset and md5 of each tar member to sumfile.index
 	} options;
+	struct {
+		struct cursor_bitrot load; // addfileentry, adding with ISINFILE
+		struct cursor_bitrot tar; // finishfile_scantar, adding with ISFOUND
+		struct cursor_bitrot find; // unsafe_findfile, nothing is added
+	} cursors;
 	struct dir_bitrot topdir;
 	struct blockmem blockmem;
 };
@@ -98,5 +187,12 @@ void deinit_bitrot(struct bitrot *bitrot);
 void unprintprogress_bitrot(struct bitrot *b);
 int loadfile_bitrot(int *isnotfound_out, struct bitrot *bitrot, char *sumfile);
 int writefile_bitrot(struct bitrot *b, char *filename);
+int loadshards_bitrot(int *isnotfound_out, struct bitrot *b, char *dirname);
+int writeshards_bitrot(struct bitrot *b);
+int savefile_bitrot(struct bitrot *b, char *filename);
+int writen_bitrot(int fd, unsigned char *msg, unsigned int len);
 int printtree_bitrot(struct bitrot *b, FILE *fout);
+int setsubtree_bitrot(struct bitrot *b, char *path);
 int scandir_bitrot(struct bitrot *b, char *dirname);
+int verify_bitrot(struct bitrot *b, char *dirname);
+int stream_bitrot(struct bitrot *b, char *sumfile, char *dirname);
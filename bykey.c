@@ -0,0 +1,57 @@
+/*
+ * bykey.c
+ * Copyright (C) 2022 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#define _FILE_OFFSET_BITS	64
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include "common/conventions.h"
+#include "common/blockmem.h"
+
+#include "bitrot.h"
+#include "bykey.h"
+
+#define node_treeskel keyed_bitrot
+#define find2_treeskel find2_bykey
+#define addnode2_treeskel addnode2_bykey
+#define rmnode2_treeskel rmnode2_bykey
+#define LEFT(a)	((a)->treevars.left)
+#define RIGHT(a)	((a)->treevars.right)
+#define BALANCE(a)	((a)->treevars.balance)
+#define cmp bykeycmp
+
+struct keyed_bitrot *key_find2_bykey(struct keyed_bitrot *root, uint64_t key1, uint64_t key2) {
+struct keyed_bitrot match;
+match.key1=key1;
+match.key2=key2;
+return find2_bykey(root,&match);
+}
+
+static int bykeycmp(struct keyed_bitrot *a, struct keyed_bitrot *b) {
+if (a->key1!=b->key1) return (a->key1<b->key1)?-1:1;
+if (a->key2!=b->key2) return (a->key2<b->key2)?-1:1;
+return 0;
+}
+
+#line 1 "bykey.c/common/treeskel.c"
+#include "common/treeskel.c"
@@ -0,0 +1,23 @@
+/*
+ * bykey.h
+ * Copyright (C) 2022 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+void addnode2_bykey(struct keyed_bitrot **root_inout, struct keyed_bitrot *node);
+void rmnode2_bykey(struct keyed_bitrot **root_inout, struct keyed_bitrot *node, struct keyed_bitrot **found_out);
+struct keyed_bitrot *find2_bykey(struct keyed_bitrot *root, struct keyed_bitrot *match);
+struct keyed_bitrot *key_find2_bykey(struct keyed_bitrot *root, uint64_t key1, uint64_t key2);
+unsigned int findmaxdepth_bykey(struct keyed_bitrot *root);
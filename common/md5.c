@@ -137,12 +137,9 @@ static inline uint32_t G(uint32_t x, uint32_t y, uint32_t z) { return (x&z)|(y&(
 static inline uint32_t H(uint32_t x, uint32_t y, uint32_t z) { return x^y^z; }
 static inline uint32_t I(uint32_t x, uint32_t y, uint32_t z) { return y^(x|(~z)); }
 
-static inline void addblock(struct context_md5 *ctx, unsigned char *block) {
-uint32_t X[16];
+static inline void addX(struct context_md5 *ctx, uint32_t *X) {
 uint32_t A,B,C,D;
 
-(void)copyblocktoX(X,block);
-
 A=ctx->A;
 B=ctx->B;
 C=ctx->C;
@@ -242,6 +239,18 @@ ctx->C+=C;
 ctx->D+=D;
 }
 
+static inline void addblock(struct context_md5 *ctx, unsigned char *block) {
+uint32_t X[16];
+(void)copyblocktoX(X,block);
+(void)addX(ctx,X);
+}
+
+static void addzeroblock(struct context_md5 *ctx) {
+// X is constant, so the compiler can fold it into the rounds
+uint32_t X[16]={0};
+(void)addX(ctx,X);
+}
+
 void addbytes_context_md5(struct context_md5 *ctx, unsigned char *bytes, unsigned int len) {
 ctx->bitcount64+=len*8;
 if (ctx->unreadbytecount) {
@@ -269,6 +278,32 @@ if (len&63) {
 }
 }
 
+void addzeros_context_md5(struct context_md5 *ctx, uint64_t len) {
+// same as addbytes_context_md5 with len zeros, without a buffer to read
+ctx->bitcount64+=len*8;
+if (ctx->unreadbytecount) {
+	unsigned int needed;
+	needed=64-ctx->unreadbytecount;
+	if (len<needed) {
+		memset(ctx->unreadbuffer+ctx->unreadbytecount,0,len);
+		ctx->unreadbytecount+=len;
+		return;
+	}
+	memset(ctx->unreadbuffer+ctx->unreadbytecount,0,needed);
+	len-=needed;
+	ctx->unreadbytecount=0;
+	(void)addblock(ctx,ctx->unreadbuffer);
+}
+while (len&(~63)) { // >=64
+	(void)addzeroblock(ctx);
+	len-=64;
+}
+if (len&63) {
+	memset(ctx->unreadbuffer,0,len);
+	ctx->unreadbytecount=len;
+}
+}
+
 static inline void addu64(unsigned char *dest, uint64_t u64) {
 *dest=u64&0xff;dest++;u64=u64>>8;
 *dest=u64&0xff;dest++;u64=u64>>8;
@@ -28,4 +28,5 @@ struct context_md5 {
 
 void clear_context_md5(struct context_md5 *ctx);
 void addbytes_context_md5(struct context_md5 *ctx, unsigned char *bytes, unsigned int len);
+void addzeros_context_md5(struct context_md5 *ctx, uint64_t len);
 void finish_context_md5(unsigned char *dest, struct context_md5 *ctx);
@@ -34,6 +34,7 @@
 #define node_treeskel file_bitrot
 #define find2_treeskel find2_filebyname
 #define addnode2_treeskel addnode2_filebyname
+#define rmnode2_treeskel rmnode2_filebyname
 #define LEFT(a)	((a)->treevars.left)
 #define RIGHT(a)	((a)->treevars.right)
 #define BALANCE(a)	((a)->treevars.balance)
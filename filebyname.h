@@ -17,6 +17,7 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 void addnode2_filebyname(struct file_bitrot **root_inout, struct file_bitrot *node);
+void rmnode2_filebyname(struct file_bitrot **root_inout, struct file_bitrot *node, struct file_bitrot **found_out);
 struct file_bitrot *find2_filebyname(struct file_bitrot *root, struct file_bitrot *match);
 struct file_bitrot *filename_find2_filebyname(struct file_bitrot *root, char *filename);
 unsigned int findmaxdepth_filebyname(struct file_bitrot *root);
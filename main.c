@@ -46,39 +46,39 @@
 #include "bitrot.h"
 #include "tarvars.h"
 
-static int writen(int fd, unsigned char *msg, unsigned int len) {
-while (len) {
-	ssize_t k;
-	k=write(fd,(char *)msg,len);
-	if (k<=0) {
-		if (k && (errno==EINTR)) continue;
-		return -1;
-	}
-	len-=k;
-	msg+=k;
-}
-return 0;
-}
-
 static void printhelp(int isstderr) {
 FILE *fout;
 fout=stdout;
 if (isstderr) fout=stderr;
 fprintf(fout,"bitrotchecker scans a directory for changes, using a file listing md5 digests, compatible with md5sum\n");
 fprintf(fout,"Usage: bitrotchecker [options] checksumfile directory\n");
+fprintf(fout,"       bitrotchecker [options] --shards checksumdir directory\n");
+fprintf(fout,"  --catalog-only: only check files in checksumfile, without listing directories\n");
+fprintf(fout,"  --changelog: append changes to checksumfile.log instead of rewriting checksumfile\n");
+fprintf(fout,"  --compact: rewrite checksumfile to include checksumfile.log\n");
 fprintf(fout,"  --dry-run: don't overwrite checksumfile\n");
 fprintf(fout,"  --follow: follow symlinks\n");
+fprintf(fout,"  --index: with --tar, write the offset and md5 of each member to checksumfile.index\n");
 fprintf(fout,"  --nothingnew: only process files in checksumfile\n");
 fprintf(fout,"  --nottoday: skip files that have changed recently\n");
 fprintf(fout,"  --one-file-system: don't cross filesystems when scanning directory\n");
+fprintf(fout,"  --prefetch N: ask the kernel to read ahead N files while hashing (default 0, off)\n");
 fprintf(fout,"  --progress: print filenames along the way\n");
 fprintf(fout,"  --savechanges: update md5 values for files that have changed\n");
+fprintf(fout,"  --shards DIR: keep checksums in DIR, one checksumfile per top-level directory\n");
+fprintf(fout,"  --shared-extents: read reflinked and deduplicated copies once (linux)\n");
 fprintf(fout,"  --slow: limit reading to approx 13MB/sec\n");
 fprintf(fout,"  --slower: limit reading to approx 1.3MB/sec\n");
 fprintf(fout,"  --slowest: limit reading to approx 130KB/sec\n");
+fprintf(fout,"  --small-files N: read files up to N bytes with one read() instead of mmap (default 65536)\n");
+fprintf(fout,"  --stream: merge a sorted checksumfile with the scan without loading it into memory\n");
+fprintf(fout,"  --subtree PATH: only scan PATH within directory, leaving other checksums alone\n");
 fprintf(fout,"  --tar: read a tar file from stdin instead of scanning\n");
+fprintf(fout,"  --tar-file PATH: read the tar file PATH instead of stdin, mapped into memory\n");
 fprintf(fout,"  --tar-stdout: relay tar file to stdout\n");
+fprintf(fout,"  --threads N: use N threads where possible\n");
 fprintf(fout,"  --verbose: print extra information\n");
+fprintf(fout,"  --verify-member PATH: with --tar-file, check PATH against checksumfile.index, can be repeated\n");
 fprintf(fout,"Examples:\n");
 fprintf(fout,"To build digests: \"$ bitrotchecker --progress  /tmp/md5s.txt /home/myhome\"\n");
 fprintf(fout,"To update digests: \"$ bitrotchecker /tmp/md5s.txt /home/myhome\"\n");
@@ -90,8 +90,12 @@ int main(int argc, char **argv) {
 struct bitrot bitrot;
 struct tarvars_bitrot tarvars;
 char *sumfile=NULL;
+char *shardsdir=NULL;
+char *subtree=NULL;
 char *rootdir=NULL;
-unsigned char *tarbuffer=NULL;
+char *tarfile=NULL;
+char **members=NULL;
+unsigned int nmembers=0;
 int istar=0,istarstdout=0;
 /*
 --slow			: throttle io
@@ -101,6 +105,19 @@ int istar=0,istarstdout=0;
 --verbose		: print more
 --progress	: print interactive progress
 --nothingnew : don't add new files from scan
+--threads N	: use N threads
+--changelog	: append changes to sumfile.log
+--compact		: merge sumfile.log into sumfile
+--stream		: don't load sumfile, merge it with a sorted scan
+--shards DIR	: use a directory of sumfiles instead of sumfile
+--subtree PATH	: only load, scan and save PATH under rootdir
+--catalog-only	: verify from the loaded tree, don't readdir
+--prefetch N	: posix_fadvise the next N files
+--small-files N	: read() files up to N bytes instead of mmap
+--shared-extents	: reuse md5s for files whose extents are all shared and identical
+--tar-file PATH	: like --tar, reading PATH with mmap instead of stdin
+--index	: write sumfile.index, header offset, data offset, size and md5 of each tar member
+--verify-member PATH	: pread PATH from --tar-file and compare it with sumfile.index
 */
 
 
@@ -133,12 +150,92 @@ for (i=1;i<argc;i++) {
 		bitrot.options.ceiling_mtime=time(NULL)-24*60*60;
 	} else if (!strcmp(arg,"--one-file-system")) {
 		bitrot.options.isonefilesystem=1;
+	} else if (!strcmp(arg,"--catalog-only")) {
+		bitrot.options.iscatalogonly=1;
+	} else if (!strcmp(arg,"--changelog")) {
+		bitrot.options.ischangelog=1;
+	} else if (!strcmp(arg,"--compact")) {
+		bitrot.options.iscompact=1;
 	} else if (!strcmp(arg,"--dry-run")) {
 		bitrot.options.isdryrun=1;
 	} else if (!strcmp(arg,"--savechanges")) {
 		bitrot.options.issavechanges=1;
+	} else if (!strcmp(arg,"--shared-extents")) {
+		bitrot.options.issharedextents=1;
+	} else if (!strcmp(arg,"--stream")) {
+		bitrot.options.isstream=1;
+	} else if (!strcmp(arg,"--shards")) {
+		i++;
+		if (i==argc) {
+			fprintf(stderr,"%s:%d --shards needs a directory\n",__FILE__,__LINE__);
+			GOTOERROR;
+		}
+		shardsdir=argv[i];
+	} else if (!strcmp(arg,"--prefetch")) {
+		i++;
+		if (i==argc) {
+			fprintf(stderr,"%s:%d --prefetch needs a number of files\n",__FILE__,__LINE__);
+			GOTOERROR;
+		}
+		bitrot.options.prefetchcount=strtoul(argv[i],NULL,10);
+	} else if (!strcmp(arg,"--small-files")) {
+		i++;
+		if (i==argc) {
+			fprintf(stderr,"%s:%d --small-files needs a size in bytes\n",__FILE__,__LINE__);
+			GOTOERROR;
+		}
+		bitrot.options.smallfilemax=strtoul(argv[i],NULL,10);
+		if (bitrot.options.smallfilemax>READCHUNK_BITROT) {
+			fprintf(stderr,"%s:%d --small-files can be at most %u\n",__FILE__,__LINE__,READCHUNK_BITROT);
+			GOTOERROR;
+		}
+	} else if (!strcmp(arg,"--subtree")) {
+		i++;
+		if (i==argc) {
+			fprintf(stderr,"%s:%d --subtree needs a path\n",__FILE__,__LINE__);
+			GOTOERROR;
+		}
+		subtree=argv[i];
+	} else if (!strcmp(arg,"--threads")) {
+		i++;
+		if (i==argc) {
+			fprintf(stderr,"%s:%d --threads needs a number\n",__FILE__,__LINE__);
+			GOTOERROR;
+		}
+		{
+			unsigned long ul;
+			char *end;
+			ul=strtoul(argv[i],&end,10);
+			if (!isdigit(argv[i][0]) || *end || !ul) { // strtoul would take "-1"
+				fprintf(stderr,"%s:%d invalid thread count %s\n",__FILE__,__LINE__,argv[i]);
+				GOTOERROR;
+			}
+			if (ul>MAX_THREADS_BITROT) ul=MAX_THREADS_BITROT;
+			bitrot.options.threads=ul;
+		}
 	} else if (!strcmp(arg,"--tar")) {
 		istar=1;
+	} else if (!strcmp(arg,"--tar-file")) {
+		i++;
+		if (i==argc) {
+			fprintf(stderr,"%s:%d --tar-file needs a path\n",__FILE__,__LINE__);
+			GOTOERROR;
+		}
+		tarfile=argv[i];
+		istar=1;
+	} else if (!strcmp(arg,"--index")) {
+		bitrot.options.isindex=1;
+	} else if (!strcmp(arg,"--verify-member")) {
+		i++;
+		if (i==argc) {
+			fprintf(stderr,"%s:%d --verify-member needs a path\n",__FILE__,__LINE__);
+			GOTOERROR;
+		}
+		if (!members) {
+			if (!(members=malloc(argc*sizeof(char *)))) GOTOERROR;
+		}
+		members[nmembers]=argv[i];
+		nmembers+=1;
 	} else if (!strcmp(arg,"--tar-stdout")) {
 		istarstdout=1;
 	} else if (!strcmp(arg,"--nothingnew")) {
@@ -190,20 +287,84 @@ if (!rootdir) {
 		return 0;
 	}
 }
-if (!sumfile) {
+if (shardsdir) {
+	if (sumfile) {
+		fprintf(stderr,"%s:%d --shards replaces the checksumfile, %s isn't needed\n",__FILE__,__LINE__,sumfile);
+		GOTOERROR;
+	}
+	if (bitrot.options.isstream || bitrot.options.ischangelog || bitrot.options.iscompact) {
+		fprintf(stderr,"%s:%d --shards doesn't work with --stream, --changelog or --compact\n",__FILE__,__LINE__);
+		GOTOERROR;
+	}
+} else if (!sumfile) {
 	printhelp(istarstdout);
 	fprintf(stderr,"\n%s:%d a filename is required, to read and store md5 checksums\n",__FILE__,__LINE__);
 	return 0;
 }
 
+if (bitrot.options.iscatalogonly && (istar || bitrot.options.isstream)) {
+	fprintf(stderr,"%s:%d --catalog-only doesn't work with --tar or --stream\n",__FILE__,__LINE__);
+	GOTOERROR;
+}
+if (bitrot.options.issharedextents && (istar || bitrot.options.iscatalogonly)) {
+	fprintf(stderr,"%s:%d --shared-extents doesn't work with --tar or --catalog-only\n",__FILE__,__LINE__);
+	GOTOERROR;
+}
+if (bitrot.options.isindex && (!istar || shardsdir || nmembers)) {
+	fprintf(stderr,"%s:%d --index needs --tar or --tar-file and doesn't work with --shards or --verify-member\n",__FILE__,__LINE__);
+	GOTOERROR;
+}
+if (nmembers && !tarfile) {
+	fprintf(stderr,"%s:%d --verify-member needs --tar-file\n",__FILE__,__LINE__);
+	GOTOERROR;
+}
+if (tarfile && istarstdout) {
+	fprintf(stderr,"%s:%d --tar-stdout only relays stdin, it doesn't work with --tar-file\n",__FILE__,__LINE__);
+	GOTOERROR;
+}
+if (bitrot.options.isstream && istar) {
+	fprintf(stderr,"%s:%d --stream needs a sorted scan and doesn't work with --tar\n",__FILE__,__LINE__);
+	GOTOERROR;
+}
+
+if (subtree) {
+	if (istar || bitrot.options.isstream || bitrot.options.iscompact) {
+		fprintf(stderr,"%s:%d --subtree doesn't work with --tar, --stream or --compact\n",__FILE__,__LINE__);
+		GOTOERROR;
+	}
+}
+
 if (init_bitrot(&bitrot)) GOTOERROR;
+if (subtree) {
+	if (setsubtree_bitrot(&bitrot,subtree)) GOTOERROR;
+}
+
+if (nmembers) { // the catalog isn't loaded, members are checked against the index
+	bitrot.options.msgout=stdout;
+	if (verifymembers_bitrot(&bitrot,sumfile,tarfile,members,nmembers)) GOTOERROR;
+	deinit_bitrot(&bitrot);
+	free(members);
+	return 0;
+}
+
+if (bitrot.options.isstream) {
+	bitrot.options.msgout=stdout;
+	if (stream_bitrot(&bitrot,sumfile,rootdir)) GOTOERROR;
+	(void)unprintprogress_bitrot(&bitrot);
+	deinit_bitrot(&bitrot);
+	return 0;
+}
 
 {
 	int isnotfound;
-	if (loadfile_bitrot(&isnotfound,&bitrot,sumfile)) GOTOERROR;
+	if (shardsdir) {
+		if (loadshards_bitrot(&isnotfound,&bitrot,shardsdir)) GOTOERROR;
+	} else {
+		if (loadfile_bitrot(&isnotfound,&bitrot,sumfile)) GOTOERROR;
+	}
 	if (isnotfound) {
 		if (bitrot.options.isverbose) {
-			fprintf(stderr,"%s:%d checksum file %s not found\n",__FILE__,__LINE__,sumfile);
+			fprintf(stderr,"%s:%d checksum file %s not found\n",__FILE__,__LINE__,shardsdir?shardsdir:sumfile);
 		}
 	}
 #if 0
@@ -214,21 +375,13 @@ if (istar) {
 	if (init_tarvars_bitrot(&tarvars)) GOTOERROR;
 	bitrot.options.msgout=stderr;
 
-	if (!(tarbuffer=malloc(READCHUNK_BITROT))) GOTOERROR;
-	while (1) {
-		int k;
-		k=read(STDIN_FILENO,tarbuffer,READCHUNK_BITROT);
-		if (k<=0) {
-			if (!k) break;
-			GOTOERROR;
-		}
-		if (istarstdout) {
-			if (writen(STDOUT_FILENO,tarbuffer,k)) GOTOERROR;
-		}
-		if (scantar_bitrot(&bitrot,&tarvars,tarbuffer,k)) GOTOERROR;
-		if (bitrot.options.readusleep) {
-			usleep(bitrot.options.readusleep);
-		}
+	if (bitrot.options.isindex) {
+		if (openindex_bitrot(&bitrot,sumfile)) GOTOERROR;
+	}
+	if (tarfile) {
+		if (readtarfile_bitrot(&bitrot,&tarvars,tarfile)) GOTOERROR;
+	} else {
+		if (readtar_bitrot(&bitrot,&tarvars,STDIN_FILENO,istarstdout?STDOUT_FILENO:-1)) GOTOERROR;
 	}
 	if (tarvars.state!=FINISHED_STATE_TARVARS_BITROT) {
 		if (tarvars.state!=HEADER_STATE_TARVARS_BITROT) {
@@ -237,27 +390,38 @@ if (istar) {
 		}
 		fprintf(stderr,"%s:%d Warning reading tar file, no end-of-file\n",__FILE__,__LINE__);
 	}
+	if (bitrot.options.isindex) {
+		if (closeindex_bitrot(&bitrot)) GOTOERROR;
+	}
 } else {
 	bitrot.options.msgout=stdout;
-	if (scandir_bitrot(&bitrot,rootdir)) GOTOERROR;
+	if (bitrot.options.iscatalogonly) {
+		if (verify_bitrot(&bitrot,rootdir)) GOTOERROR;
+	} else {
+		if (scandir_bitrot(&bitrot,rootdir)) GOTOERROR;
+	}
 }
 (void)unprintprogress_bitrot(&bitrot);
 
 // printtree_bitrot(&bitrot,stderr);
 
 if (!bitrot.options.isdryrun) {
-	if (bitrot.stats.changecount) {
-		if (writefile_bitrot(&bitrot,sumfile)) GOTOERROR;
+	if (shardsdir) {
+		if (bitrot.stats.changecount) {
+			if (writeshards_bitrot(&bitrot)) GOTOERROR;
+		}
+	} else if (bitrot.stats.changecount || (bitrot.options.iscompact && bitrot.changelog.isfound)) {
+		if (savefile_bitrot(&bitrot,sumfile)) GOTOERROR;
 	}
 }
 
-iffree(tarbuffer);
 deinit_bitrot(&bitrot);
 deinit_tarvars_bitrot(&tarvars);
+iffree(members);
 return 0;
 error:
-	iffree(tarbuffer);
 	deinit_bitrot(&bitrot);
 	deinit_tarvars_bitrot(&tarvars);
+	iffree(members);
 	return -1;
 }
@@ -30,11 +30,16 @@
 // 2 blank blocks at the end
 #define ENDBLOCKS_STATE_TARVARS_BITROT	8
 #define FINISHED_STATE_TARVARS_BITROT	9
+// pax 'x'/'g' records
+#define PAX_STATE_TARVARS_BITROT	10
 
 #define MAX_FILENAME_TARVARS_BITROT	1023
+struct ring_tar;
 struct tarvars_bitrot {
 	int state;
 	char *filename;
+	struct ring_tar *pool; // with --threads, file data is hashed by workers and finished in order
+	uint64_t offset; // tar bytes scanned so far
 	struct {
 		struct {
 			unsigned char *f_name;
@@ -55,16 +60,18 @@ struct tarvars_bitrot {
 			unsigned char *f_prefix;
 		} fields;
 		struct {
-			unsigned int namelen;
 			uint64_t size;
 			uint64_t mtime;
-			unsigned int prefixlen;
+			int isustar; // only posix headers have f_prefix
 #define NONE_FILETYPE_TARVARS_BITROT	0
 #define REGULAR_FILETYPE_TARVARS_BITROT	1
 #define LONGLINK_FILETYPE_TARVARS_BITROT	2
 #define LONGFILE_FILETYPE_TARVARS_BITROT	3
 			int filetype; 
+			int ishardlink; // fields can point into bytes that are gone by endfile_scantar
+			int islinkpath; // pax linkpath replaces f_linkname
 		} parsed;
+		uint64_t offset; // where this header starts, the data is after it
 		unsigned int bytesleft;
 		unsigned char bytes[512];
 	} header;
@@ -73,6 +80,34 @@ struct tarvars_bitrot {
 		uint64_t databytesleft;
 		unsigned char *cursor; // data is malloc'd at 1024 bytes
 	} slurp;
+	struct {
+		uint64_t inputbytesleft; // aligned to blocksize
+		uint64_t databytesleft;
+		int isglobal; // 'g' records apply to every following member
+#define LENGTH_PHASE_PAX_TARVARS	0
+#define KEY_PHASE_PAX_TARVARS	1
+#define VALUE_PHASE_PAX_TARVARS	2
+		int phase;
+		uint64_t recordleft; // after the length, including the '\n'
+		unsigned int digits;
+#define NONE_KEY_PAX_TARVARS	0
+#define PATH_KEY_PAX_TARVARS	1
+#define LINKPATH_KEY_PAX_TARVARS	2
+#define SIZE_KEY_PAX_TARVARS	3
+#define MTIME_KEY_PAX_TARVARS	4
+		int key;
+		unsigned int keylen;
+		char keybuff[16]; // longer keys aren't interesting
+		unsigned int valuelen;
+		char valuebuff[32]; // numbers only, paths go to their own buffers
+		int haspath,haslinkpath,hassize,hasmtime; // for the next member
+		uint64_t size,mtime;
+		char *linkpath;
+		struct {
+			int hasmtime;
+			uint64_t mtime;
+		} global;
+	} pax;
 	struct {
 		unsigned char md5[LEN_MD5_BITROT];
 		uint64_t inputbytesleft; // aligned to blocksize
@@ -88,3 +123,8 @@ H_CLEARFUNC(tarvars_bitrot);
 int init_tarvars_bitrot(struct tarvars_bitrot *tb);
 void deinit_tarvars_bitrot(struct tarvars_bitrot *tb);
 int scantar_bitrot(struct bitrot *b, struct tarvars_bitrot *tb, unsigned char *bytes, unsigned int len);
+int readtar_bitrot(struct bitrot *b, struct tarvars_bitrot *tb, int fdin, int fdout);
+int readtarfile_bitrot(struct bitrot *b, struct tarvars_bitrot *tb, char *filename);
+int openindex_bitrot(struct bitrot *b, char *sumfile);
+int closeindex_bitrot(struct bitrot *b);
+int verifymembers_bitrot(struct bitrot *b, char *sumfile, char *tarfile, char **members, unsigned int count);